@@ -0,0 +1,202 @@
+/*
+ * Ion xrandr module
+ *
+ * See the README for copyright information.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License,or (at your option) any later version.
+ */
+
+/*
+ * The outputs last laid out and their screens are kept in the session 
+ * directory, so that at startup the screens can be put in place before 
+ * the server has been probed. The file is only ever read back by the same
+ * build of the module on the same machine, so it holds the structures as
+ * they are in memory; the header tells if they match.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/Xrandr.h>
+
+#include <libtu/misc.h>
+#include <libextl/readconfig.h>
+
+#include <ioncore/common.h>
+#include "xrandr.h"
+#include "cache.h"
+
+
+#define CACHE_FILE "xrandr_topology.cache"
+#define CACHE_MAGIC 0x43525258 /* "XRRC" */
+#define CACHE_VERSION 1
+
+
+typedef struct{
+    unsigned int magic;
+    unsigned int version;
+    unsigned int entry_size;
+    int width;
+    int height;
+    int noutputs;
+} CacheHeader;
+
+typedef struct{
+    struct xrandr_output_info info;
+    int screen_id;
+} CacheEntry;
+
+
+static char *cache_path()
+{
+    const char *dir=extl_sessiondir();
+    char *path=NULL;
+    
+    if(dir==NULL)
+        return NULL;
+    
+    libtu_asprintf(&path, "%s/%s", dir, CACHE_FILE);
+    
+    return path;
+}
+
+
+bool xrandr_cache_save(const struct xrandr_snapshot *snap, 
+                       const int *screen_ids, int width, int height)
+{
+    char *path=cache_path(), *tmp=NULL;
+    CacheHeader hdr;
+    bool ok=TRUE;
+    FILE *f;
+    int i;
+    
+    if(path==NULL)
+        return FALSE;
+    
+    libtu_asprintf(&tmp, "%s.tmp", path);
+    
+    if(tmp==NULL){
+        free(path);
+        return FALSE;
+    }
+    
+    f=fopen(tmp, "wb");
+    
+    if(f==NULL){
+        free(tmp);
+        free(path);
+        return FALSE;
+    }
+    
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic=CACHE_MAGIC;
+    hdr.version=CACHE_VERSION;
+    hdr.entry_size=sizeof(CacheEntry);
+    hdr.width=width;
+    hdr.height=height;
+    hdr.noutputs=snap->noutputs;
+    
+    ok=(fwrite(&hdr, sizeof(hdr), 1, f)==1);
+    
+    for(i=0; ok && i<snap->noutputs; i++){
+        CacheEntry e;
+        
+        memset(&e, 0, sizeof(e));
+        e.info=snap->outputs[i];
+        e.screen_id=screen_ids[i];
+        ok=(fwrite(&e, sizeof(e), 1, f)==1);
+    }
+    
+    if(fclose(f)!=0)
+        ok=FALSE;
+    
+    /* replaced in one go, so that a crash leaves the old file */
+    if(ok)
+        ok=(rename(tmp, path)==0);
+    
+    if(!ok)
+        unlink(tmp);
+    
+    free(tmp);
+    free(path);
+    
+    return ok;
+}
+
+
+struct xrandr_snapshot *xrandr_cache_load(int width, int height,
+                                          int **screen_ids)
+{
+    struct xrandr_snapshot *snap=NULL;
+    const CacheHeader *hdr;
+    const CacheEntry *entries;
+    char *path=cache_path();
+    struct stat st;
+    void *map;
+    int fd, i;
+    
+    *screen_ids=NULL;
+    
+    if(path==NULL)
+        return NULL;
+    
+    fd=open(path, O_RDONLY);
+    free(path);
+    
+    if(fd<0)
+        return NULL;
+    
+    if(fstat(fd, &st)!=0 || st.st_size<(off_t)sizeof(CacheHeader)){
+        close(fd);
+        return NULL;
+    }
+    
+    map=mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    
+    if(map==MAP_FAILED)
+        return NULL;
+    
+    hdr=(const CacheHeader*)map;
+    entries=(const CacheEntry*)(hdr+1);
+    
+    /* stale if the root has another size than it was laid out for */
+    if(hdr->magic!=CACHE_MAGIC || hdr->version!=CACHE_VERSION ||
+       hdr->entry_size!=sizeof(CacheEntry) ||
+       hdr->width!=width || hdr->height!=height ||
+       hdr->noutputs<=0 ||
+       st.st_size!=(off_t)(sizeof(CacheHeader)+
+                           hdr->noutputs*sizeof(CacheEntry))){
+        goto out;
+    }
+    
+    *screen_ids=ALLOC_N(int, hdr->noutputs);
+    
+    if(*screen_ids==NULL)
+        goto out;
+    
+    snap=xrandr_snapshot_new(hdr->noutputs);
+    
+    if(snap==NULL){
+        free(*screen_ids);
+        *screen_ids=NULL;
+        goto out;
+    }
+    
+    for(i=0; i<hdr->noutputs; i++){
+        snap->outputs[i]=entries[i].info;
+        snap->outputs[i].name[XRANDR_NAME_MAX-1]='\0';
+        (*screen_ids)[i]=entries[i].screen_id;
+    }
+    
+out:
+    munmap(map, st.st_size);
+    return snap;
+}
@@ -0,0 +1,32 @@
+/*
+ * Ion xrandr module
+ *
+ * See the README for copyright information.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License,or (at your option) any later version.
+ */
+
+#ifndef ION_MOD_XRANDR_CACHE_H
+#define ION_MOD_XRANDR_CACHE_H
+
+#include <ioncore/common.h>
+#include "xrandr.h"
+
+/** 
+ * save the outputs of snap, laid out on a root of width x height, with 
+ * the ids of their screens to the session directory 
+ */
+extern bool xrandr_cache_save(const struct xrandr_snapshot *snap, 
+                              const int *screen_ids, int width, int height);
+
+/** 
+ * the outputs saved for a root of width x height, or NULL. *screen_ids is
+ * set to an array of their screen ids, to be freed by the caller. 
+ */
+extern struct xrandr_snapshot *xrandr_cache_load(int width, int height,
+                                                 int **screen_ids);
+
+#endif /* ION_MOD_XRANDR_CACHE_H */
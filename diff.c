@@ -0,0 +1,104 @@
+/*
+ * Ion xrandr module
+ *
+ * See the README for copyright information.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License,or (at your option) any later version.
+ */
+
+#include <string.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/Xrandr.h>
+
+#include <ioncore/common.h>
+#include "diff.h"
+
+
+static bool same_output(const struct xrandr_output_info *a,
+                        const struct xrandr_output_info *b)
+{
+    return (a->id==b->id && strcmp(a->name, b->name)==0);
+}
+
+
+static struct xrandr_output_info *find_output(struct xrandr_output_info *infos,
+                                              int n,
+                                              const struct xrandr_output_info *o)
+{
+    int i;
+    
+    for(i=0; i<n; i++){
+        if(same_output(&infos[i], o))
+            return &infos[i];
+    }
+    
+    return NULL;
+}
+
+
+static int classify(const struct xrandr_output_info *o,
+                    const struct xrandr_output_info *n)
+{
+    int changes=XRANDR_OUTPUT_UNCHANGED;
+    
+    if(o->x!=n->x || o->y!=n->y)
+        changes|=XRANDR_OUTPUT_MOVED;
+    if(o->w!=n->w || o->h!=n->h)
+        changes|=XRANDR_OUTPUT_RESIZED;
+    if(o->rotation!=n->rotation)
+        changes|=XRANDR_OUTPUT_ROTATED;
+    
+    return changes;
+}
+
+
+int xrandr_diff_outputs(struct xrandr_output_info *old, int nold,
+                        struct xrandr_output_info *new, int nnew,
+                        struct xrandr_output_change *changes)
+{
+    int i, n=0;
+    
+    for(i=0; i<nnew; i++){
+        struct xrandr_output_info *o=find_output(old, nold, &new[i]);
+        
+        changes[n].old_info=o;
+        changes[n].new_info=&new[i];
+        changes[n].changes=(o==NULL 
+                            ? XRANDR_OUTPUT_ADDED
+                            : classify(o, &new[i]));
+        n++;
+    }
+    
+    for(i=0; i<nold; i++){
+        if(find_output(new, nnew, &old[i])==NULL){
+            changes[n].old_info=&old[i];
+            changes[n].new_info=NULL;
+            changes[n].changes=XRANDR_OUTPUT_REMOVED;
+            n++;
+        }
+    }
+    
+    return n;
+}
+
+
+bool xrandr_outputs_equal(const struct xrandr_output_info *a, int na,
+                         const struct xrandr_output_info *b, int nb)
+{
+    int i;
+    
+    if(na!=nb)
+        return FALSE;
+    
+    for(i=0; i<na; i++){
+        if(!same_output(&a[i], &b[i]) || 
+           classify(&a[i], &b[i])!=XRANDR_OUTPUT_UNCHANGED){
+            return FALSE;
+        }
+    }
+    
+    return TRUE;
+}
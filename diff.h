@@ -0,0 +1,50 @@
+/*
+ * Ion xrandr module
+ *
+ * See the README for copyright information.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License,or (at your option) any later version.
+ */
+
+#ifndef ION_MOD_XRANDR_DIFF_H
+#define ION_MOD_XRANDR_DIFF_H
+
+#include "xrandr.h"
+
+#define XRANDR_OUTPUT_UNCHANGED 0x00
+#define XRANDR_OUTPUT_ADDED     0x01
+#define XRANDR_OUTPUT_REMOVED   0x02
+#define XRANDR_OUTPUT_MOVED     0x04
+#define XRANDR_OUTPUT_RESIZED   0x08
+#define XRANDR_OUTPUT_ROTATED   0x10
+
+struct xrandr_output_change
+{
+    int changes;
+    /** NULL for added outputs */
+    struct xrandr_output_info *old_info;
+    /** NULL for removed outputs */
+    struct xrandr_output_info *new_info;
+};
+
+/**
+ * Compare two output snapshots. changes must have room for nold+nnew 
+ * entries. The first nnew entries describe the new outputs in order, 
+ * followed by one entry for each removed output. Returns the number of 
+ * entries filled in.
+ */
+extern int xrandr_diff_outputs(struct xrandr_output_info *old, int nold,
+                               struct xrandr_output_info *new, int nnew,
+                               struct xrandr_output_change *changes);
+
+/**
+ * True if a and b list the same outputs in the same order, with the same
+ * geometry and rotation: xrandr_diff_outputs would find no changes.
+ */
+extern bool xrandr_outputs_equal(const struct xrandr_output_info *a, int na,
+                                 const struct xrandr_output_info *b, int nb);
+
+#endif /* ION_MOD_XRANDR_DIFF_H */
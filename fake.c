@@ -0,0 +1,326 @@
+/*
+ * Ion xrandr module
+ *
+ * See the README for copyright information.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License,or (at your option) any later version.
+ */
+
+/*
+ * In-memory topology provider. Scripts can make up monitor setups and
+ * hotplug sequences to exercise the layout code without any RandR
+ * capable X server.
+ */
+
+#include <string.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/Xrandr.h>
+
+#include <libtu/misc.h>
+#include <libextl/extl.h>
+
+#include <ioncore/common.h>
+#include "xrandr.h"
+#include "stats.h"
+#include "mod_xrandr.h"
+#include "fake.h"
+
+
+static struct xrandr_output_info *fake_outputs=NULL;
+static int fake_noutputs=0;
+/* bumped on every change, used as the configuration timestamp */
+static Time fake_generation=0;
+
+
+static struct xrandr_snapshot *fake_probe(Display *dpy, Bool reprobe)
+{
+    struct xrandr_snapshot *snap=xrandr_snapshot_new(fake_noutputs);
+
+    if(snap==NULL)
+        return NULL;
+    
+    if(fake_noutputs>0){
+        memcpy(snap->outputs, fake_outputs,
+               fake_noutputs*sizeof(struct xrandr_output_info));
+    }
+
+    snap->reprobed=reprobe;
+    snap->timestamp=fake_generation;
+    snap->config_timestamp=fake_generation;
+
+    return snap;
+}
+
+
+static const struct xrandr_backend fake_backend={
+    "fake", fake_probe, False
+};
+
+
+/* The same connector name always gives the same output XID */
+static RROutput fake_output_id(const char *name)
+{
+    unsigned long h=5381;
+
+    while(*name!='\0')
+        h=h*33+(unsigned char)*name++;
+
+    /* XIDs have 29 bits */
+    return (RROutput)((h&0x1fffffff)|1);
+}
+
+
+static bool fake_output_get(ExtlTab tab, int i,
+                            struct xrandr_output_info *o)
+{
+    char *name=NULL;
+    int degrees=0, mm_w=0, mm_h=0;
+    bool primary=FALSE;
+
+    if(!extl_table_gets_s(tab, "name", &name))
+        return FALSE;
+
+    if(!extl_table_gets_i(tab, "x", &o->x) ||
+       !extl_table_gets_i(tab, "y", &o->y) ||
+       !extl_table_gets_i(tab, "w", &o->w) ||
+       !extl_table_gets_i(tab, "h", &o->h) ||
+       o->w<=0 || o->h<=0){
+        free(name);
+        return FALSE;
+    }
+
+    extl_table_gets_i(tab, "rotation", &degrees);
+    extl_table_gets_i(tab, "mm_width", &mm_w);
+    extl_table_gets_i(tab, "mm_height", &mm_h);
+    extl_table_gets_b(tab, "primary", &primary);
+    
+    o->refresh=60;
+    extl_table_gets_d(tab, "refresh", &o->refresh);
+
+    strncpy(o->name, name, XRANDR_NAME_MAX-1);
+    o->name[XRANDR_NAME_MAX-1]='\0';
+    o->id=fake_output_id(o->name);
+    o->crtc=i+1;
+    o->mode=i+1;
+    o->rotation=xrandr_rotation(degrees);
+    if(o->rotation==0)
+        o->rotation=RR_Rotate_0;
+    o->mm_width=(mm_w>0 ? mm_w : 0);
+    o->mm_height=(mm_h>0 ? mm_h : 0);
+    o->primary=primary;
+
+    free(name);
+
+    return TRUE;
+}
+
+
+/* Replace the fake topology with the outputs in tab */
+static bool fake_topology_set(ExtlTab tab)
+{
+    int i, n=extl_table_get_n(tab);
+    struct xrandr_output_info *outputs=NULL;
+
+    if(n>0){
+        outputs=ALLOC_N(struct xrandr_output_info, n);
+        if(outputs==NULL)
+            return FALSE;
+    }
+
+    for(i=0; i<n; i++){
+        ExtlTab otab;
+        bool ok;
+
+        if(!extl_table_geti_t(tab, i+1, &otab)){
+            warn("Output %d of the fake topology is not a table.", i+1);
+            free(outputs);
+            return FALSE;
+        }
+
+        ok=fake_output_get(otab, i, &outputs[i]);
+        extl_unref_table(otab);
+
+        if(!ok){
+            warn("Output %d of the fake topology needs a name, x, y, w "
+                 "and h.", i+1);
+            free(outputs);
+            return FALSE;
+        }
+    }
+
+    free(fake_outputs);
+    fake_outputs=outputs;
+    fake_noutputs=n;
+    fake_generation++;
+
+    xrandr_set_backend(&fake_backend);
+
+    return TRUE;
+}
+
+
+/*EXTL_DOC
+ * Replace the monitors reported by the X server by a made up topology,
+ * for testing. \var{outputs} is a list of tables with the fields
+ * \var{name}, \var{x}, \var{y}, \var{w}, \var{h} and optionally
+ * \var{rotation} in degrees, \var{refresh}, \var{mm_width}, 
+ * \var{mm_height} and \var{primary}. Every call is handled like a change
+ * event reported by the server. Returns false if \var{outputs} is 
+ * invalid.
+ */
+EXTL_EXPORT
+bool mod_xrandr_fake_set(ExtlTab outputs)
+{
+    if(!fake_topology_set(outputs))
+        return FALSE;
+
+    xrandr_schedule_relayout();
+
+    return TRUE;
+}
+
+
+/*EXTL_DOC
+ * Relayout the screens \var{steps} times, cycling through the fake
+ * topologies in \var{sequence} (a list of tables as accepted by
+ * \fnref{mod_xrandr.fake_set}), without waiting for the relayout delay.
+ * Returns the total time taken in milliseconds, or a negative value if
+ * \var{sequence} is invalid or a probe of the X server is still in 
+ * progress, as the relayouts would then only be put off.
+ */
+EXTL_EXPORT
+double mod_xrandr_fake_run(ExtlTab sequence, int steps)
+{
+    int i, n=extl_table_get_n(sequence);
+    double start;
+
+    if(n<=0)
+        return -1;
+    
+    if(xrandr_probe_in_progress()){
+        warn("A probe is in progress, try again later.");
+        return -1;
+    }
+
+    start=xrandr_stats_now();
+
+    for(i=0; i<steps; i++){
+        ExtlTab tab;
+        bool ok;
+
+        if(!extl_table_geti_t(sequence, i%n+1, &tab))
+            return -1;
+
+        ok=fake_topology_set(tab);
+        extl_unref_table(tab);
+
+        if(!ok)
+            return -1;
+
+        xrandr_relayout(FALSE);
+    }
+
+    return xrandr_stats_now()-start;
+}
+
+
+/*EXTL_DOC
+ * Relayout the screens for each step of \var{recording}, a list made by
+ * \fnref{mod_xrandr.record_start}, with its outputs as the fake topology
+ * and without waiting for the relayout delay. The topology in use before,
+ * that of the X server unless one was faked, is laid out again at the 
+ * end. Returns a list of the time each step took in milliseconds, or nil 
+ * if \var{recording} is invalid or a probe of the X server is still in 
+ * progress, as the relayouts would then only be put off.
+ */
+EXTL_EXPORT
+ExtlTab mod_xrandr_replay(ExtlTab recording)
+{
+    int i, n=extl_table_get_n(recording);
+    bool was_fake=(xrandr_get_backend()==&fake_backend);
+    struct xrandr_output_info *saved=NULL;
+    int nsaved=fake_noutputs;
+    ExtlTab times;
+    
+    if(xrandr_probe_in_progress()){
+        warn("A probe is in progress, try the replay again later.");
+        return extl_table_none();
+    }
+    
+    if(was_fake && nsaved>0){
+        saved=ALLOC_N(struct xrandr_output_info, nsaved);
+        if(saved==NULL)
+            return extl_table_none();
+        memcpy(saved, fake_outputs, nsaved*sizeof(struct xrandr_output_info));
+    }
+    
+    times=extl_create_table();
+    
+    for(i=0; i<n; i++){
+        ExtlTab step, outputs;
+        bool ok=FALSE;
+        double start;
+        
+        if(extl_table_geti_t(recording, i+1, &step)){
+            if(extl_table_gets_t(step, "outputs", &outputs)){
+                ok=fake_topology_set(outputs);
+                extl_unref_table(outputs);
+            }
+            extl_unref_table(step);
+        }
+        
+        if(!ok){
+            warn("Step %d of the recording is invalid.", i+1);
+            extl_unref_table(times);
+            times=extl_table_none();
+            break;
+        }
+        
+        start=xrandr_stats_now();
+        xrandr_relayout(FALSE);
+        extl_table_seti_d(times, i+1, xrandr_stats_now()-start);
+    }
+    
+    if(was_fake){
+        free(fake_outputs);
+        fake_outputs=saved;
+        fake_noutputs=nsaved;
+        fake_generation++;
+        xrandr_set_backend(&fake_backend);
+        xrandr_relayout(FALSE);
+    }else{
+        xrandr_fake_deinit();
+        xrandr_relayout(TRUE);
+    }
+    
+    return times;
+}
+
+
+/*EXTL_DOC
+ * Go back to the monitors reported by the X server after
+ * \fnref{mod_xrandr.fake_set} and relayout.
+ */
+EXTL_EXPORT
+void mod_xrandr_fake_reset()
+{
+    if(xrandr_get_backend()!=&fake_backend)
+        return;
+
+    xrandr_fake_deinit();
+    xrandr_relayout(TRUE);
+}
+
+
+void xrandr_fake_deinit()
+{
+    if(xrandr_get_backend()==&fake_backend)
+        xrandr_set_backend(NULL);
+
+    free(fake_outputs);
+    fake_outputs=NULL;
+    fake_noutputs=0;
+}
@@ -0,0 +1,18 @@
+/*
+ * Ion xrandr module
+ *
+ * See the README for copyright information.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License,or (at your option) any later version.
+ */
+
+#ifndef ION_MOD_XRANDR_FAKE_H
+#define ION_MOD_XRANDR_FAKE_H
+
+/** switch back to the X server and forget the fake topology */
+extern void xrandr_fake_deinit();
+
+#endif /* ION_MOD_XRANDR_FAKE_H */
@@ -0,0 +1,424 @@
+/*
+ * Ion xrandr module
+ *
+ * See the README for copyright information.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License,or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/Xrandr.h>
+
+#include <libtu/misc.h>
+#include <libextl/extl.h>
+
+#include <ioncore/common.h>
+#include <ioncore/global.h>
+#include "xrandr.h"
+#include "mod_xrandr.h"
+
+
+#define LAYOUT_ERROR_MAX 256
+
+
+static void copy_name(char *dst, const char *src)
+{
+    strncpy(dst, src, XRANDR_NAME_MAX-1);
+    dst[XRANDR_NAME_MAX-1]='\0';
+}
+
+
+static bool output_config_get(ExtlTab tab, struct xrandr_output_config *c)
+{
+    char *s=NULL;
+    bool b=FALSE;
+    int degrees=0;
+    
+    if(!extl_table_gets_s(tab, "name", &s))
+        return FALSE;
+    copy_name(c->name, s);
+    free(s);
+    
+    c->enabled=!(extl_table_gets_b(tab, "off", &b) && b);
+    
+    if(extl_table_gets_s(tab, "mode", &s)){
+        copy_name(c->mode, s);
+        free(s);
+    }
+    
+    extl_table_gets_d(tab, "refresh", &c->refresh);
+    extl_table_gets_i(tab, "x", &c->x);
+    extl_table_gets_i(tab, "y", &c->y);
+    
+    extl_table_gets_i(tab, "rotation", &degrees);
+    c->rotation=xrandr_rotation(degrees);
+    if(c->rotation==0)
+        return FALSE;
+    
+    c->primary=(extl_table_gets_b(tab, "primary", &b) && b);
+    
+    return TRUE;
+}
+
+
+struct xrandr_output_config *xrandr_layout_from_table(ExtlTab tab, int *n)
+{
+    struct xrandr_output_config *configs;
+    int i;
+    
+    *n=extl_table_get_n(tab);
+    
+    if(*n<=0){
+        warn("Empty layout.");
+        return NULL;
+    }
+    
+    configs=ALLOC_N(struct xrandr_output_config, *n);
+    
+    if(configs==NULL)
+        return NULL;
+    
+    for(i=0; i<*n; i++){
+        ExtlTab otab;
+        bool ok=FALSE;
+        
+        if(extl_table_geti_t(tab, i+1, &otab)){
+            ok=output_config_get(otab, &configs[i]);
+            extl_unref_table(otab);
+        }
+        
+        if(!ok){
+            warn("Output %d of the layout needs a name and a rotation of "
+                 "0, 90, 180 or 270 degrees.", i+1);
+            free(configs);
+            return NULL;
+        }
+    }
+    
+    return configs;
+}
+
+
+/*
+ * The probe state of the current layout is used if it is there; after
+ * relayouts from change events alone, it has to be fetched. *probed is 
+ * set to the snapshot to free afterwards.
+ */
+static struct xrandr_snapshot *probe_state(struct xrandr_snapshot **probed)
+{
+    struct xrandr_snapshot *snap=xrandr_current_snapshot();
+    
+    *probed=NULL;
+    
+    if(!xrandr_get_backend()->x_events)
+        return NULL;
+    
+    if(snap==NULL || snap->res==NULL)
+        snap=*probed=xrandr_probe(ioncore_g.dpy, FALSE);
+    
+    return snap;
+}
+
+
+static bool apply_plan(const struct xrandr_plan *plan, const char *error,
+                       const char *what)
+{
+    char apply_error[LAYOUT_ERROR_MAX];
+    
+    if(plan==NULL){
+        warn("Cannot apply %s: %s.", what, error);
+        return FALSE;
+    }
+    
+    if(!xrandr_plan_is_empty(plan) &&
+       !xrandr_plan_apply(ioncore_g.dpy, plan, 
+                          apply_error, sizeof(apply_error))){
+        warn("Cannot apply %s: %s.", what, apply_error);
+        return FALSE;
+    }
+    
+    return TRUE;
+}
+
+
+static bool apply_configs(struct xrandr_snapshot *snap, 
+                          const struct xrandr_output_config *configs, int n,
+                          const char *what)
+{
+    char error[LAYOUT_ERROR_MAX]="no RandR";
+    struct xrandr_plan *plan=NULL;
+    bool ok;
+    
+    if(snap!=NULL)
+        plan=xrandr_plan_layout(snap, configs, n, error, sizeof(error));
+    
+    ok=apply_plan(plan, error, what);
+    
+    xrandr_plan_free(plan);
+    
+    return ok;
+}
+
+
+/*EXTL_DOC
+ * Configure the outputs as described by \var{layout}, a list of tables
+ * with the fields \var{name} (of the connector), and optionally \var{off},
+ * \var{mode} (such as \code{"1920x1080"}, the preferred mode if not
+ * given), \var{refresh}, \var{x}, \var{y}, \var{rotation} in degrees and
+ * \var{primary}. Outputs not in \var{layout} are left as they are.
+ * 
+ * The whole layout is checked against the modes and crtcs the X server
+ * reported before anything is changed. It is then applied in one go: 
+ * the screen is resized at most once and all crtcs are set with the 
+ * server grabbed. Returns false if the layout could not be applied.
+ */
+EXTL_EXPORT
+bool mod_xrandr_apply(ExtlTab layout)
+{
+    struct xrandr_output_config *configs;
+    struct xrandr_snapshot *probed;
+    bool ok;
+    int n;
+    
+    if(!xrandr_get_backend()->x_events){
+        warn("Layouts can only be applied to the X server.");
+        return FALSE;
+    }
+    
+    configs=xrandr_layout_from_table(layout, &n);
+    
+    if(configs==NULL)
+        return FALSE;
+    
+    ok=apply_configs(probe_state(&probed), configs, n, "the layout");
+    
+    xrandr_snapshot_free(probed);
+    free(configs);
+    
+    return ok;
+}
+
+
+/*
+ * Profiles
+ */
+
+
+typedef struct Profile_struct{
+    char *name;
+    struct xrandr_output_config *configs;
+    int nconfigs;
+    /* worked out in advance, for the server state of the two timestamps */
+    struct xrandr_plan *plan;
+    Time plan_timestamp, plan_config_timestamp;
+    struct Profile_struct *next;
+} Profile;
+
+
+static Profile *profiles=NULL;
+
+
+static Profile **find_profile(const char *name)
+{
+    Profile **p;
+    
+    for(p=&profiles; *p!=NULL; p=&(*p)->next){
+        if(strcmp((*p)->name, name)==0)
+            break;
+    }
+    
+    return p;
+}
+
+
+static void profile_free(Profile *p)
+{
+    xrandr_plan_free(p->plan);
+    free(p->name);
+    free(p->configs);
+    free(p);
+}
+
+
+/*
+ * A plan is only good for the server state it was made against, so the
+ * one made in advance is used if nothing has been changed since.
+ */
+static struct xrandr_plan *profile_plan(Profile *p, 
+                                        struct xrandr_snapshot *snap,
+                                        char *error, int errlen)
+{
+    if(p->plan!=NULL && p->plan_timestamp==snap->timestamp &&
+       p->plan_config_timestamp==snap->config_timestamp){
+        return p->plan;
+    }
+    
+    xrandr_plan_free(p->plan);
+    p->plan=xrandr_plan_layout(snap, p->configs, p->nconfigs, error, errlen);
+    p->plan_timestamp=snap->timestamp;
+    p->plan_config_timestamp=snap->config_timestamp;
+    
+    return p->plan;
+}
+
+
+static bool profile_activate(Profile *p, struct xrandr_snapshot *snap)
+{
+    char what[LAYOUT_ERROR_MAX];
+    char error[LAYOUT_ERROR_MAX]="no RandR";
+    struct xrandr_plan *plan=NULL;
+    
+    snprintf(what, sizeof(what), "profile %s", p->name);
+    
+    if(snap!=NULL)
+        plan=profile_plan(p, snap, error, sizeof(error));
+    
+    return apply_plan(plan, error, what);
+}
+
+
+bool xrandr_have_profiles()
+{
+    return (profiles!=NULL);
+}
+
+
+/*EXTL_DOC
+ * Register the layout profile \var{name}. \var{layout} is in the format
+ * of \fnref{mod_xrandr.apply} and must list every output that is to be 
+ * connected when the profile is used, including those to turn off. 
+ * Whenever monitors are plugged or unplugged, the first registered 
+ * profile mentioning exactly the connected outputs is applied. The 
+ * outputs that are connected now are checked when the profile is 
+ * registered; the function returns false if they cannot be set up as 
+ * \var{layout} says. A profile of the same name is replaced.
+ */
+EXTL_EXPORT
+bool mod_xrandr_add_profile(const char *name, ExtlTab layout)
+{
+    char error[LAYOUT_ERROR_MAX]="no RandR";
+    struct xrandr_snapshot *snap, *probed;
+    Profile *p, **old;
+    bool ok;
+    
+    p=ALLOC(Profile);
+    
+    if(p==NULL)
+        return FALSE;
+    
+    p->plan=NULL;
+    p->name=scopy(name);
+    p->configs=xrandr_layout_from_table(layout, &p->nconfigs);
+    
+    if(p->name==NULL || p->configs==NULL){
+        profile_free(p);
+        return FALSE;
+    }
+    
+    snap=probe_state(&probed);
+    ok=(snap==NULL || 
+        xrandr_check_layout(snap, p->configs, p->nconfigs, 
+                            error, sizeof(error)));
+    
+    /* a profile for what is connected now is planned right away */
+    if(ok && snap!=NULL && 
+       xrandr_layout_matches(snap, p->configs, p->nconfigs)){
+        profile_plan(p, snap, NULL, 0);
+    }
+    
+    xrandr_snapshot_free(probed);
+    
+    if(!ok){
+        warn("Invalid profile %s: %s.", name, error);
+        profile_free(p);
+        return FALSE;
+    }
+    
+    old=find_profile(name);
+    if(*old!=NULL){
+        p->next=(*old)->next;
+        profile_free(*old);
+    }
+    *old=p;
+    
+    return TRUE;
+}
+
+
+/*EXTL_DOC
+ * Forget the layout profile \var{name}.
+ */
+EXTL_EXPORT
+void mod_xrandr_remove_profile(const char *name)
+{
+    Profile **p=find_profile(name);
+    Profile *next;
+    
+    if(*p==NULL)
+        return;
+    
+    next=(*p)->next;
+    profile_free(*p);
+    *p=next;
+}
+
+
+/*EXTL_DOC
+ * Apply the layout profile \var{name} now.
+ */
+EXTL_EXPORT
+bool mod_xrandr_activate_profile(const char *name)
+{
+    struct xrandr_snapshot *probed;
+    Profile *p=*find_profile(name);
+    bool ok;
+    
+    if(p==NULL){
+        warn("No profile %s.", name);
+        return FALSE;
+    }
+    
+    ok=profile_activate(p, probe_state(&probed));
+    xrandr_snapshot_free(probed);
+    
+    return ok;
+}
+
+
+/*
+ * While there are profiles, relayouts after outputs change query the 
+ * server, so the current snapshot has the probe state; nothing is 
+ * probed here.
+ */
+void xrandr_profiles_hotplug()
+{
+    struct xrandr_snapshot *snap=xrandr_current_snapshot();
+    Profile *p;
+    
+    if(profiles==NULL || snap==NULL || snap->res==NULL ||
+       !xrandr_get_backend()->x_events){
+        return;
+    }
+    
+    for(p=profiles; p!=NULL; p=p->next){
+        if(xrandr_layout_matches(snap, p->configs, p->nconfigs)){
+            profile_activate(p, snap);
+            break;
+        }
+    }
+}
+
+
+void xrandr_profiles_deinit()
+{
+    while(profiles!=NULL){
+        Profile *next=profiles->next;
+        profile_free(profiles);
+        profiles=next;
+    }
+}
@@ -30,16 +30,32 @@
 
 #include <libtu/rb.h>
 #include <libtu/objp.h>
+#include <libtu/misc.h>
+#include <libextl/extl.h>
+#include <libmainloop/signal.h>
+#include <libmainloop/hooks.h>
+#include <libmainloop/defer.h>
 
 #include <ioncore/common.h>
 #include <ioncore/eventh.h>
 #include <ioncore/global.h>
 #include <ioncore/event.h>
 #include <ioncore/mplex.h>
+#include <ioncore/screen.h>
 #include <ioncore/stacking.h>
 #include <ioncore/xwindow.h>
+#include <ioncore/window.h>
 #include <ioncore/../version.h>
 #include "xrandr.h"
+#include "diff.h"
+#include "stats.h"
+#include "trace.h"
+#include "mod_xrandr.h"
+#include "fake.h"
+#include "worker.h"
+#include "cache.h"
+#include "record.h"
+#include "exports.h"
 
 char mod_xrandr_ion_api_version[]=ION_API_VERSION;
 
@@ -47,179 +63,1473 @@ static bool hasXrandR=FALSE;
 static int xrr_event_base;
 static int xrr_error_base;
 
-Rb_node rotations=NULL;
+/* Quiet period (msec) after the last change event before relayouting */
+#define RELAYOUT_DELAY_DEFAULT 100
+
+static WTimer *relayout_timer=NULL;
+static int relayout_delay=RELAYOUT_DELAY_DEFAULT;
+static int pending_events=0;
+static int last_absorbed=0;
+static int relayout_count=0;
+static bool last_reprobed=FALSE;
+static bool last_queried=FALSE;
+
+/* the probe thread is probing for the relayout in progress */
+static bool probe_pending=FALSE;
+/* relayout asked for meanwhile, to be done when the probe is in */
+static bool relayout_again=FALSE;
+static bool reprobe_again=FALSE;
+
+/* start of the current event burst, or <0 if there is none */
+static double burst_start=-1;
+/* cost of the relayout in progress */
+static int relayout_round_trips=0;
+static int relayout_screens_touched=0;
+
+/* Outputs the screens were last laid out for */
+static struct xrandr_snapshot *snapshot=NULL;
+
+/* snapshot patched by the RRNotify events received since */
+static struct xrandr_snapshot *delta=NULL;
+static bool need_query=TRUE;
+
+/*
+ * The crtc, mode and rotation of the active outputs as last probed and
+ * told by events since, so that queries can make do with the monitor 
+ * list. Entries without an output are crtcs in use whose outputs are not
+ * known yet. Until the crtcs and outputs are walked again, the table is 
+ * not trusted if walk_outputs is set.
+ */
+#define OUTPUT_STATES_MAX 32
+
+static struct xrandr_output_state output_states[OUTPUT_STATES_MAX];
+static int noutput_states=0;
+static bool walk_outputs=TRUE;
+
+/* 
+ * The timestamps of the last probe, to recognise change events that do 
+ * not change anything
+ */
+static bool layout_probed=FALSE;
+static Time layout_timestamp=CurrentTime;
+static Time layout_config_timestamp=CurrentTime;
+/* the server has RandR 1.5 monitors, which change without RRNotify events */
+static bool layout_monitors=FALSE;
+static int skipped_events=0;
+static int skipped_relayouts=0;
+
+/* set when outputs are plugged or unplugged, to look for a profile */
+static bool outputs_changed=FALSE;
+
+/* Called with a description of the changes after each relayout */
+WHook *xrandr_layout_changed_hook=NULL;
+
+/* Gamma of crtcs, fetched when asked for and kept until the crtc changes */
+static Rb_node gamma_cache=NULL;
+
+/* 
+ * Screens are kept attached to the physical output they were made for,
+ * identified by output XID and connector name. The screen of an output
+ * that goes away is parked: detached and unmapped with its contents 
+ * intact, until the output comes back.
+ */
+typedef struct{
+    RROutput id;
+    char name[XRANDR_NAME_MAX];
+    int screen_id;
+    Watch screen;
+    bool parked;
+} OutputScreen;
+
+static Rb_node output_screens=NULL;
+static int next_screen_id=0;
 
 static int rr2scrrot(int rr)
 {
-    switch(rr){
-    case RR_Rotate_0: return SCREEN_ROTATION_0; 
-    case RR_Rotate_90: return SCREEN_ROTATION_90; 
-    case RR_Rotate_180: return SCREEN_ROTATION_180; 
-    case RR_Rotate_270: return SCREEN_ROTATION_270; 
-    default: return SCREEN_ROTATION_0; 
+    switch(rr){
+    case RR_Rotate_0: return SCREEN_ROTATION_0; 
+    case RR_Rotate_90: return SCREEN_ROTATION_90; 
+    case RR_Rotate_180: return SCREEN_ROTATION_180; 
+    case RR_Rotate_270: return SCREEN_ROTATION_270; 
+    default: return SCREEN_ROTATION_0; 
+    }
+}
+
+/* Rotation that turns a screen from the crtc rotation from to to */
+static int rotation_between(Rotation from, Rotation to)
+{
+    int or=rr2scrrot(from&0xf);
+    int r=rr2scrrot(to&0xf);
+    
+    return (r>=or
+            ? SCREEN_ROTATION_0+r-or
+            : (SCREEN_ROTATION_270+1)+r-or);
+}
+
+
+static WRegion *getexistingscreen(WMPlex *mplex, int index)
+{
+    WMPlexIterTmp tmp;
+    WRegion *reg;
+    int current_idx = 0;
+    FOR_ALL_MANAGED_BY_MPLEX(mplex, reg, tmp){
+        if (index == current_idx)
+            return reg;
+        current_idx++;
+    }
+    return NULL;
+}
+
+static int output_screen_cmp(const void *k, const void *v)
+{
+    const OutputScreen *key=(const OutputScreen*)k;
+    const OutputScreen *os=(const OutputScreen*)v;
+    
+    if(key->id!=os->id)
+        return (key->id<os->id ? -1 : 1);
+    return strcmp(key->name, os->name);
+}
+
+static OutputScreen *find_output_screen(const struct xrandr_output_info *o)
+{
+    OutputScreen key;
+    Rb_node node;
+    int found;
+    
+    key.id=o->id;
+    strcpy(key.name, o->name);
+    
+    node=rb_find_gkey_n(output_screens, &key, output_screen_cmp, &found);
+    
+    return (found ? (OutputScreen*)node->v.val : NULL);
+}
+
+static WScreen *output_screen_get(OutputScreen *os)
+{
+    if(os==NULL || !watch_ok(&os->screen))
+        return NULL;
+    return (WScreen*)os->screen.obj;
+}
+
+/*
+ * Remember scr as the screen of the output o. os is the existing entry 
+ * for o, if any.
+ */
+static OutputScreen *output_screen_set(const struct xrandr_output_info *o, 
+                                       OutputScreen *os, WScreen *scr)
+{
+    if(os==NULL){
+        os=ALLOC(OutputScreen);
+        if(os==NULL)
+            return NULL;
+        os->id=o->id;
+        strcpy(os->name, o->name);
+        os->screen_id=next_screen_id++;
+        os->parked=FALSE;
+        watch_init(&os->screen);
+        if(rb_insertg(output_screens, os, os, output_screen_cmp)==NULL){
+            free(os);
+            return NULL;
+        }
+    }
+    
+    if(scr!=NULL)
+        watch_setup(&os->screen, (Obj*)scr, NULL);
+    
+    return os;
+}
+
+/* True if scr already is the screen of some output */
+static bool screen_claimed(WScreen *scr)
+{
+    Rb_node node;
+    
+    rb_traverse(node, output_screens){
+        if(output_screen_get((OutputScreen*)node->v.val)==scr)
+            return TRUE;
+    }
+    
+    return FALSE;
+}
+
+static void park_screen(OutputScreen *os)
+{
+    WScreen *scr=output_screen_get(os);
+    
+    if(scr==NULL || os->parked)
+        return;
+    
+    region_detach_manager((WRegion*)scr);
+    region_unmap((WRegion*)scr);
+    os->parked=TRUE;
+}
+
+/*
+ * Attach a parked screen back to the root. Attaching fits it to fp once.
+ */
+static bool unpark_screen(OutputScreen *os, const WFitParams *fp)
+{
+    WScreen *scr=output_screen_get(os);
+    WMPlexAttachParams par=MPLEXATTACHPARAMS_INIT;
+    WRegionAttachData data;
+    
+    if(scr==NULL || !os->parked)
+        return FALSE;
+    
+    par.flags=MPLEX_ATTACH_GEOM|MPLEX_ATTACH_SIZEPOLICY|MPLEX_ATTACH_UNNUMBERED;
+    par.geom=fp->g;
+    par.szplcy=SIZEPOLICY_FULL_EXACT;
+    
+    data.type=REGION_ATTACH_REPARENT;
+    data.u.reg=(WRegion*)scr;
+    
+    if(mplex_do_attach(&ioncore_g.rootwins->scr.mplex, &par, &data)==NULL)
+        return FALSE;
+    
+    os->parked=FALSE;
+    return TRUE;
+}
+
+/*
+ * Give the parked screens back to the root, so nothing is lost when the
+ * module goes away.
+ */
+static void unpark_all_screens()
+{
+    Rb_node node;
+    
+    if(output_screens==NULL)
+        return;
+    
+    rb_traverse(node, output_screens){
+        OutputScreen *os=(OutputScreen*)node->v.val;
+        WScreen *scr=output_screen_get(os);
+        
+        if(scr!=NULL && os->parked){
+            WFitParams fp;
+            fp.g=REGION_GEOM(scr);
+            fp.mode=REGION_FIT_EXACT;
+            unpark_screen(os, &fp);
+        }
+    }
+}
+
+static void free_output_screens()
+{
+    Rb_node node;
+    
+    if(output_screens==NULL)
+        return;
+    
+    rb_traverse(node, output_screens){
+        OutputScreen *os=(OutputScreen*)node->v.val;
+        watch_reset(&os->screen);
+        free(os);
+    }
+    
+    rb_free_tree(output_screens);
+    output_screens=NULL;
+}
+
+static void gamma_cache_invalidate(RRCrtc crtc)
+{
+    Rb_node node;
+    int found;
+    
+    if(gamma_cache==NULL)
+        return;
+    
+    node=rb_find_ikey_n(gamma_cache, (int)crtc, &found);
+    
+    if(found){
+        free(node->v.val);
+        rb_delete_node(node);
+    }
+}
+
+static struct xrandr_gamma *gamma_cache_get(RRCrtc crtc)
+{
+    struct xrandr_gamma *gamma;
+    Rb_node node;
+    int found;
+    
+    if(gamma_cache==NULL){
+        gamma_cache=make_rb();
+        if(gamma_cache==NULL)
+            return NULL;
+    }
+    
+    node=rb_find_ikey_n(gamma_cache, (int)crtc, &found);
+    
+    if(found)
+        return (struct xrandr_gamma*)node->v.val;
+    
+    gamma=ALLOC(struct xrandr_gamma);
+    
+    if(gamma==NULL)
+        return NULL;
+    
+    if(!xrandr_crtc_gamma(ioncore_g.dpy, crtc, gamma) ||
+       rb_inserti(gamma_cache, (int)crtc, gamma)==NULL){
+        free(gamma);
+        return NULL;
+    }
+    
+    return gamma;
+}
+
+static void free_gamma_cache()
+{
+    Rb_node node;
+    
+    if(gamma_cache==NULL)
+        return;
+    
+    rb_traverse(node, gamma_cache){
+        free(node->v.val);
+    }
+    
+    rb_free_tree(gamma_cache);
+    gamma_cache=NULL;
+}
+
+int xrandr_rotation_degrees(Rotation r)
+{
+    if(r&RR_Rotate_90)
+        return 90;
+    if(r&RR_Rotate_180)
+        return 180;
+    if(r&RR_Rotate_270)
+        return 270;
+    return 0;
+}
+
+Rotation xrandr_rotation(int degrees)
+{
+    switch(degrees){
+    case 0: return RR_Rotate_0;
+    case 90: return RR_Rotate_90;
+    case 180: return RR_Rotate_180;
+    case 270: return RR_Rotate_270;
+    default: return 0;
+    }
+}
+
+struct xrandr_snapshot *xrandr_current_snapshot()
+{
+    return snapshot;
+}
+
+bool xrandr_probe_in_progress()
+{
+    return probe_pending;
+}
+
+static const struct xrandr_output_info *find_output_info(const char *name)
+{
+    int i;
+    
+    if(snapshot==NULL)
+        return NULL;
+    
+    for(i=0; i<snapshot->noutputs; i++){
+        if(strcmp(snapshot->outputs[i].name, name)==0)
+            return &snapshot->outputs[i];
+    }
+    
+    return NULL;
+}
+
+static WScreen *screen_of_output(const struct xrandr_output_info *o)
+{
+    return output_screen_get(find_output_screen(o));
+}
+
+static ExtlTab output_table(const struct xrandr_output_info *o)
+{
+    ExtlTab tab=extl_create_table();
+    WScreen *scr=screen_of_output(o);
+    
+    extl_table_sets_s(tab, "name", o->name);
+    extl_table_sets_i(tab, "x", o->x);
+    extl_table_sets_i(tab, "y", o->y);
+    extl_table_sets_i(tab, "w", o->w);
+    extl_table_sets_i(tab, "h", o->h);
+    extl_table_sets_i(tab, "rotation", xrandr_rotation_degrees(o->rotation));
+    extl_table_sets_d(tab, "refresh", o->refresh);
+    extl_table_sets_i(tab, "mm_width", (int)o->mm_width);
+    extl_table_sets_i(tab, "mm_height", (int)o->mm_height);
+    extl_table_sets_b(tab, "primary", o->primary);
+    if(scr!=NULL)
+        extl_table_sets_o(tab, "screen", (Obj*)scr);
+    
+    return tab;
+}
+
+static void table_set_geom(ExtlTab tab, const char *key,
+                           const struct xrandr_output_info *o)
+{
+    ExtlTab g=extl_create_table();
+    
+    extl_table_sets_i(g, "x", o->x);
+    extl_table_sets_i(g, "y", o->y);
+    extl_table_sets_i(g, "w", o->w);
+    extl_table_sets_i(g, "h", o->h);
+    extl_table_sets_i(g, "rotation", xrandr_rotation_degrees(o->rotation));
+    extl_table_sets_t(tab, key, g);
+    extl_unref_table(g);
+}
+
+static void table_append(ExtlTab list, ExtlTab tab)
+{
+    extl_table_seti_t(list, extl_table_get_n(list)+1, tab);
+    extl_unref_table(tab);
+}
+
+/*
+ * Describe the changes for xrandr_layout_changed_hook. Returns 
+ * extl_table_none() if nothing changed.
+ */
+static ExtlTab changes_table(struct xrandr_output_change *changes, int n)
+{
+    ExtlTab tab, added, removed, changed;
+    bool any=FALSE;
+    int i;
+    
+    for(i=0; i<n; i++){
+        if(changes[i].changes!=XRANDR_OUTPUT_UNCHANGED)
+            any=TRUE;
+    }
+    
+    if(!any)
+        return extl_table_none();
+    
+    tab=extl_create_table();
+    added=extl_create_table();
+    removed=extl_create_table();
+    changed=extl_create_table();
+    
+    for(i=0; i<n; i++){
+        struct xrandr_output_change *c=&changes[i];
+        ExtlTab ctab;
+        WScreen *scr;
+        
+        if(c->changes&XRANDR_OUTPUT_ADDED){
+            table_append(added, output_table(c->new_info));
+        }else if(c->changes&XRANDR_OUTPUT_REMOVED){
+            ctab=extl_create_table();
+            scr=screen_of_output(c->old_info);
+            extl_table_sets_s(ctab, "name", c->old_info->name);
+            table_set_geom(ctab, "old", c->old_info);
+            if(scr!=NULL)
+                extl_table_sets_o(ctab, "screen", (Obj*)scr);
+            table_append(removed, ctab);
+        }else if(c->changes!=XRANDR_OUTPUT_UNCHANGED){
+            ctab=output_table(c->new_info);
+            table_set_geom(ctab, "old", c->old_info);
+            table_set_geom(ctab, "new", c->new_info);
+            extl_table_sets_b(ctab, "moved", 
+                              c->changes&XRANDR_OUTPUT_MOVED);
+            extl_table_sets_b(ctab, "resized", 
+                              c->changes&XRANDR_OUTPUT_RESIZED);
+            extl_table_sets_b(ctab, "rotated", 
+                              c->changes&XRANDR_OUTPUT_ROTATED);
+            table_append(changed, ctab);
+        }
+    }
+    
+    extl_table_sets_t(tab, "added", added);
+    extl_table_sets_t(tab, "removed", removed);
+    extl_table_sets_t(tab, "changed", changed);
+    extl_unref_table(added);
+    extl_unref_table(removed);
+    extl_unref_table(changed);
+    
+    return tab;
+}
+
+static bool layout_changed_marshall(ExtlFn fn, ExtlTab *tab)
+{
+    return extl_call(fn, "t", NULL, *tab);
+}
+
+static bool geom_eq(const WRectangle *a, const WRectangle *b)
+{
+    return (a->x==b->x && a->y==b->y && a->w==b->w && a->h==b->h);
+}
+
+/*
+ * Start patching a fresh copy of the outputs of the last relayout
+ */
+static void reset_delta()
+{
+    xrandr_snapshot_free(delta);
+    delta=xrandr_snapshot_copy(snapshot);
+    need_query=FALSE;
+}
+
+/*
+ * A relayout is done as a transaction: the final geometry of every screen
+ * is worked out first, and then each screen is fitted exactly once, so 
+ * that no client window is configured more than once per relayout.
+ */
+typedef enum{
+    RELAYOUT_FIT,
+    RELAYOUT_ROTATE,
+    RELAYOUT_UNPARK,
+    RELAYOUT_CREATE
+} RelayoutOp;
+
+typedef struct{
+    RelayoutOp op;
+    const struct xrandr_output_info *output;
+    OutputScreen *os;
+    WScreen *screen;
+    WFitParams fp;
+} RelayoutStep;
+
+typedef struct{
+    RelayoutStep *steps;
+    int nsteps;
+    OutputScreen **parks;
+    int nparks;
+} RelayoutTransaction;
+
+static RelayoutStep *relayout_add(RelayoutTransaction *t, RelayoutOp op,
+                                  const struct xrandr_output_info *output,
+                                  OutputScreen *os, WScreen *screen)
+{
+    RelayoutStep *step=&t->steps[t->nsteps++];
+    
+    step->op=op;
+    step->output=output;
+    step->os=os;
+    step->screen=screen;
+    step->fp.g.x=output->x;
+    step->fp.g.y=output->y;
+    step->fp.g.w=output->w;
+    step->fp.g.h=output->h;
+    step->fp.mode=REGION_FIT_EXACT;
+    
+    return step;
+}
+
+static WScreen *create_output_screen(const struct xrandr_output_info *output,
+                                     OutputScreen *os, const WFitParams *fp)
+{
+    WMPlexAttachParams par = MPLEXATTACHPARAMS_INIT;
+    WScreen* newScreen;
+    
+    par.flags = MPLEX_ATTACH_GEOM|MPLEX_ATTACH_SIZEPOLICY|MPLEX_ATTACH_UNNUMBERED;
+    par.geom = fp->g;
+    par.szplcy = SIZEPOLICY_FULL_EXACT;
+
+    newScreen = (WScreen*) mplex_do_attach_new(&ioncore_g.rootwins->scr.mplex, &par,
+        (WRegionCreateFn*)create_screen, NULL);
+    if (newScreen == NULL)
+        return NULL;
+    
+    os = output_screen_set(output, os, newScreen);
+    if (os != NULL)
+        newScreen->id = os->screen_id;
+    
+    return newScreen;
+}
+
+/*
+ * mplex_fitrep refits the managed regions without passing the rotation 
+ * on, so the screen window is fitted and its contents rotated separately.
+ */
+static void rotate_screen(WScreen *scr, const WFitParams *fp)
+{
+    WMPlex *mplex=&scr->mplex;
+    WFitParams mfp;
+    bool wchg=(REGION_GEOM(scr).w!=fp->g.w);
+    bool hchg=(REGION_GEOM(scr).h!=fp->g.h);
+    
+    window_do_fitrep(&mplex->win, NULL, &fp->g);
+    
+    mfp.mode=fp->mode;
+    mfp.rotation=fp->rotation;
+    mplex_managed_geom(mplex, &mfp.g);
+    mplex_do_fit_managed(mplex, &mfp);
+    
+    mplex_size_changed(mplex, wchg, hchg);
+}
+
+static const int step_trace[]={
+    XRANDR_TRACE_FIT, XRANDR_TRACE_ROTATE, XRANDR_TRACE_UNPARK, 
+    XRANDR_TRACE_CREATE
+};
+
+/* 
+ * Carry out one step of a transaction, returning the time it took
+ */
+static double relayout_step(RelayoutStep *step)
+{
+    double t0=xrandr_stats_now(), ms;
+    
+    switch(step->op){
+    case RELAYOUT_FIT:
+        region_fitrep((WRegion*)step->screen, NULL, &step->fp);
+        break;
+    case RELAYOUT_ROTATE:
+        rotate_screen(step->screen, &step->fp);
+        break;
+    case RELAYOUT_UNPARK:
+        /* 
+         * If it cannot be attached back, it stays parked and only 
+         * follows the output; the next relayout tries again.
+         */
+        if(!unpark_screen(step->os, &step->fp))
+            region_fitrep((WRegion*)step->screen, NULL, &step->fp);
+        break;
+    case RELAYOUT_CREATE:
+        create_output_screen(step->output, step->os, &step->fp);
+        break;
+    }
+    
+    ms=xrandr_stats_now()-t0;
+    xrandr_trace(step_trace[step->op], t0, ms,
+                 step->os!=NULL ? step->os->screen_id : -1);
+    
+    return ms;
+}
+
+/*
+ * Apply the transaction, flushing only at the end. Screens are parked, 
+ * attached back and created first: that runs ioncore code and hooks, 
+ * which may wait for other clients and so must not run with the server
+ * grabbed. The fits are then done with the server grabbed, so that 
+ * clients see the new layout at once.
+ */
+static void relayout_commit(RelayoutTransaction *t)
+{
+    double attach_ms=0, fit_ms=0, t0;
+    int i;
+    
+    relayout_screens_touched=t->nsteps+t->nparks;
+    
+    if(t->nsteps==0 && t->nparks==0)
+        return;
+    
+    for(i=0; i<t->nparks; i++){
+        t0=xrandr_stats_now();
+        park_screen(t->parks[i]);
+        attach_ms+=xrandr_stats_now()-t0;
+        xrandr_trace(XRANDR_TRACE_PARK, t0, xrandr_stats_now()-t0, 
+                     t->parks[i]->screen_id);
+    }
+    
+    for(i=0; i<t->nsteps; i++){
+        RelayoutStep *step=&t->steps[i];
+        
+        if(step->op==RELAYOUT_UNPARK || step->op==RELAYOUT_CREATE)
+            attach_ms+=relayout_step(step);
+    }
+    
+    XGrabServer(ioncore_g.dpy);
+    
+    for(i=0; i<t->nsteps; i++){
+        RelayoutStep *step=&t->steps[i];
+        
+        if(step->op==RELAYOUT_FIT || step->op==RELAYOUT_ROTATE)
+            fit_ms+=relayout_step(step);
+    }
+    
+    XUngrabServer(ioncore_g.dpy);
+    XFlush(ioncore_g.dpy);
+    
+    xrandr_stats_phase(XRANDR_STAT_ATTACH, attach_ms);
+    xrandr_stats_phase(XRANDR_STAT_FIT, fit_ms);
+}
+
+static int count_changes(const struct xrandr_output_change *changes, int n)
+{
+    int i, count=0;
+    
+    for(i=0; i<n; i++){
+        if(changes[i].changes!=XRANDR_OUTPUT_UNCHANGED)
+            count++;
+    }
+    
+    return count;
+}
+
+/*
+ * Take snap as the current snapshot without touching any screen, when it
+ * has exactly the outputs of the current one and each of them still has
+ * its screen, attached and where the output is.
+ */
+static bool skip_snapshot(struct xrandr_snapshot *snap)
+{
+    struct xrandr_snapshot *old = snapshot;
+    int i;
+    
+    if (snapshot == NULL ||
+        !xrandr_outputs_equal(snapshot->outputs, snapshot->noutputs,
+                              snap->outputs, snap->noutputs))
+        return FALSE;
+    
+    for (i = 0; i < snap->noutputs; i++){
+        const struct xrandr_output_info *o = &snap->outputs[i];
+        OutputScreen *os = find_output_screen(o);
+        WScreen *scr = output_screen_get(os);
+        WRectangle g;
+        
+        g.x = o->x;
+        g.y = o->y;
+        g.w = o->w;
+        g.h = o->h;
+        
+        if (scr == NULL || os->parked || !geom_eq(&REGION_GEOM(scr), &g))
+            return FALSE;
+    }
+    
+    xrandr_record_snapshot(snap, last_absorbed);
+    
+    /* the new one may have the probe state the old one lacks */
+    snapshot = snap;
+    xrandr_snapshot_free(old);
+    reset_delta();
+    
+    skipped_relayouts++;
+    return TRUE;
+}
+
+/*
+ * Put a WScreen on each monitor of snap, which then replaces the current
+ * snapshot.
+ *
+ * The new outputs are compared with those of the previous call, and only
+ * screens whose geometry actually changed are refitted. Returns FALSE if
+ * neither the outputs nor the screens changed.
+ */
+static bool apply_snapshot(struct xrandr_snapshot *snap)
+{
+    struct xrandr_output_info *output_infos = snap->outputs;
+    int screencount = snap->noutputs;
+    struct xrandr_output_info *prev_outputs = (snapshot ? snapshot->outputs : NULL);
+    int prev_output_count = (snapshot ? snapshot->noutputs : 0);
+    struct xrandr_snapshot *old;
+    int screennr;
+    int existingscreencount = 0;
+    int nchanges, i;
+    WRootWin* rootWin = ioncore_g.rootwins;
+    struct xrandr_output_change *changes;
+    RelayoutTransaction t;
+    ExtlTab payload;
+    double t0;
+    bool changed;
+    WMPlexIterTmp tmp;
+    WRegion *reg;
+
+    if (skip_snapshot(snap))
+        return FALSE;
+
+    changes = ALLOC_N(struct xrandr_output_change, prev_output_count+screencount+1);
+    t.steps = ALLOC_N(RelayoutStep, screencount+1);
+    t.parks = ALLOC_N(OutputScreen*, prev_output_count+1);
+    t.nsteps = 0;
+    t.nparks = 0;
+    if (changes == NULL || t.steps == NULL || t.parks == NULL){
+        free(changes);
+        free(t.steps);
+        free(t.parks);
+        xrandr_snapshot_free(snap);
+        return FALSE;
+    }
+    xrandr_record_snapshot(snap, last_absorbed);
+    
+    t0 = xrandr_stats_now();
+    nchanges = xrandr_diff_outputs(prev_outputs, prev_output_count,
+                                   output_infos, screencount, changes);
+    xrandr_stats_phase(XRANDR_STAT_DIFF, xrandr_stats_now()-t0);
+    xrandr_trace(XRANDR_TRACE_DIFF, t0, xrandr_stats_now()-t0, 
+                 count_changes(changes, nchanges));
+
+    /* On the first layout, the screens that already exist are taken 
+     * over in order. After that, screens stay with their output. */
+    if (snapshot == NULL) {
+        FOR_ALL_MANAGED_BY_MPLEX(&rootWin->scr.mplex, reg, tmp){
+            existingscreencount++;
+        }
+
+        /* disregard the last one - this is probably the hidden root screen? */
+        if (existingscreencount > 0)
+            existingscreencount--;
+    }
+
+    /* the screens of outputs that went away are parked */
+    for (i = screencount; i < nchanges; i++){
+        OutputScreen *os = find_output_screen(changes[i].old_info);
+        if (os != NULL)
+            t.parks[t.nparks++] = os;
+    }
+
+    for (screennr = 0; screennr < screencount; screennr++){
+        struct xrandr_output_info* output_info = &output_infos[screennr];
+        OutputScreen *os = find_output_screen(output_info);
+        WScreen *existingscreen = output_screen_get(os);
+        WRectangle g;
+        
+        g.x = output_info->x;
+        g.y = output_info->y;
+        g.w = output_info->w;
+        g.h = output_info->h;
+        
+        if (existingscreen == NULL && screennr < existingscreencount) {
+            existingscreen = (WScreen*)getexistingscreen(&rootWin->scr.mplex, 
+                                                         screennr);
+            /* it may have been given to another output by the cache */
+            if (existingscreen != NULL && screen_claimed(existingscreen))
+                existingscreen = NULL;
+            if (existingscreen != NULL) {
+                os = output_screen_set(output_info, os, existingscreen);
+                if (os != NULL)
+                    os->screen_id = existingscreen->id;
+                if (existingscreen->id >= next_screen_id)
+                    next_screen_id = existingscreen->id + 1;
+            }
+        }
+        
+        if (existingscreen == NULL) {
+            relayout_add(&t, RELAYOUT_CREATE, output_info, os, NULL);
+        } else if (os != NULL && os->parked) {
+            relayout_add(&t, RELAYOUT_UNPARK, output_info, os, existingscreen);
+        } else if (changes[screennr].changes & XRANDR_OUTPUT_ROTATED) {
+            /* the contents of the screen turn with it */
+            RelayoutStep *step = relayout_add(&t, RELAYOUT_ROTATE, output_info,
+                                              os, existingscreen);
+            step->fp.mode |= REGION_FIT_ROTATE;
+            step->fp.rotation = 
+                rotation_between(changes[screennr].old_info->rotation,
+                                 output_info->rotation);
+        } else if (changes[screennr].changes != XRANDR_OUTPUT_UNCHANGED ||
+                   !geom_eq(&REGION_GEOM(existingscreen), &g)) {
+            relayout_add(&t, RELAYOUT_FIT, output_info, os, existingscreen);
+        }
+    }
+
+    /* Every screen gets its final geometry from the transaction, so the
+     * root is not refitted: that would configure them all once more. */
+    relayout_commit(&t);
+
+    rootWin->scr.id = -2;
+    
+    /* the old outputs are still needed for the description */
+    payload = changes_table(changes, nchanges);
+    changed = (t.nsteps > 0 || t.nparks > 0 || 
+               count_changes(changes, nchanges) > 0);
+    
+    free(changes);
+    free(t.steps);
+    free(t.parks);
+    
+    old = snapshot;
+    snapshot = snap;
+    xrandr_snapshot_free(old);
+    
+    reset_delta();
+    
+    /* run the hook last, so that its functions see the new layout */
+    if (payload != extl_table_none()) {
+        hook_call_p(xrandr_layout_changed_hook, &payload,
+                    (WHookMarshallExtl*)layout_changed_marshall);
+        extl_unref_table(payload);
+    }
+    
+    return changed;
+}
+
+/*
+ * Save the outputs laid out and their screens, for the next start. This
+ * writes a file, so it is only done after relayouts that changed 
+ * something.
+ */
+static void save_topology()
+{
+    const WRectangle *g=&REGION_GEOM(ioncore_g.rootwins);
+    int *screen_ids;
+    int i;
+    
+    if(snapshot==NULL || !xrandr_get_backend()->x_events)
+        return;
+    
+    screen_ids=ALLOC_N(int, snapshot->noutputs+1);
+    
+    if(screen_ids==NULL)
+        return;
+    
+    for(i=0; i<snapshot->noutputs; i++){
+        OutputScreen *os=find_output_screen(&snapshot->outputs[i]);
+        screen_ids[i]=(os!=NULL ? os->screen_id : -1);
+    }
+    
+    xrandr_cache_save(snapshot, screen_ids, g->w, g->h);
+    free(screen_ids);
+}
+
+/*
+ * Put the screens where they were when the module last ran, without
+ * talking to the server. The probe that follows corrects the layout. 
+ * Returns FALSE if there is nothing saved for a root of this size.
+ */
+static bool load_topology()
+{
+    const WRectangle *g=&REGION_GEOM(ioncore_g.rootwins);
+    struct xrandr_snapshot *snap;
+    int *screen_ids;
+    int i;
+    
+    snap=xrandr_cache_load(g->w, g->h, &screen_ids);
+    
+    if(snap==NULL)
+        return FALSE;
+    
+    for(i=0; i<snap->noutputs; i++){
+        WScreen *scr;
+        OutputScreen *os;
+        
+        if(screen_ids[i]<0)
+            continue;
+        
+        if(screen_ids[i]>=next_screen_id)
+            next_screen_id=screen_ids[i]+1;
+        
+        scr=ioncore_find_screen_id(screen_ids[i]);
+        
+        if(scr!=NULL && 
+           (scr==&ioncore_g.rootwins->scr || screen_claimed(scr))){
+            continue;
+        }
+        
+        /* a screen that is not there yet is made with the saved id */
+        os=output_screen_set(&snap->outputs[i], 
+                             find_output_screen(&snap->outputs[i]), scr);
+        if(os!=NULL)
+            os->screen_id=screen_ids[i];
+    }
+    
+    free(screen_ids);
+    
+    apply_snapshot(snap);
+    
+    /* events are not applied to a layout that was never probed */
+    need_query=TRUE;
+    
+    return TRUE;
+}
+
+/* 
+ * Record that output is on crtc with mode and rotation, or that it is
+ * off if either is None. With output None, crtc is in use by outputs
+ * not known yet. Knowing an output on a crtc makes the crtc known.
+ */
+static void output_state_set(RROutput output, RRCrtc crtc, RRMode mode,
+                             Rotation rotation)
+{
+    struct xrandr_output_state *st;
+    int i;
+    
+    for(i=0; i<noutput_states; ){
+        st=&output_states[i];
+        
+        if((output!=None && st->output==output) || 
+           (st->output==None && st->crtc==crtc)){
+            noutput_states--;
+            memmove(st, st+1, (noutput_states-i)*sizeof(*st));
+            continue;
+        }
+        i++;
+    }
+    
+    if(crtc==None || mode==None)
+        return;
+    
+    if(noutput_states==OUTPUT_STATES_MAX){
+        walk_outputs=TRUE;
+        return;
+    }
+    
+    st=&output_states[noutput_states++];
+    st->output=output;
+    st->crtc=crtc;
+    st->mode=mode;
+    st->rotation=rotation;
+}
+
+static void crtc_state_set(RRCrtc crtc, RRMode mode, Rotation rotation)
+{
+    bool found=FALSE;
+    int i;
+    
+    for(i=0; i<noutput_states; i++){
+        struct xrandr_output_state *st=&output_states[i];
+        
+        if(st->output!=None && st->crtc==crtc){
+            st->mode=mode;
+            st->rotation=rotation;
+            found=TRUE;
+        }
+    }
+    
+    if(!found)
+        output_state_set(None, crtc, mode, rotation);
+}
+
+/*
+ * Start the table over from a probe of the crtcs and outputs. The outputs
+ * of monitors made of several crtcs are left out, so those make the next
+ * query walk the crtcs and outputs again.
+ */
+static void output_states_probed(struct xrandr_snapshot *snap)
+{
+    int i;
+    
+    noutput_states=0;
+    walk_outputs=FALSE;
+    
+    for(i=0; i<snap->noutputs; i++){
+        const struct xrandr_output_info *o=&snap->outputs[i];
+        output_state_set(o->id, o->crtc, o->mode, o->rotation);
+    }
+}
+
+/*
+ * Whether the next query can be of the monitor list alone. The crtcs and
+ * outputs are walked for reprobes, for profiles, which are planned 
+ * against them, and when the probe and the events since did not tell 
+ * what every crtc in use drives.
+ */
+static bool monitors_enough(bool reprobe)
+{
+    int i;
+    
+    if(reprobe || walk_outputs || !layout_monitors || 
+       xrandr_have_profiles() || !xrandr_get_backend()->x_events){
+        return FALSE;
+    }
+    
+    for(i=0; i<noutput_states; i++){
+        if(output_states[i].output==None)
+            return FALSE;
     }
+    
+    return TRUE;
 }
 
+/*
+ * Fill in a probe of the monitor list from the table. Returns FALSE if 
+ * the table does not tell enough; snap is then only good for freeing.
+ */
+static bool complete_snapshot(struct xrandr_snapshot *snap)
+{
+    if(!snap->monitors_only)
+        return TRUE;
+    
+    return (monitors_enough(FALSE) && 
+            xrandr_complete_snapshot(snap, output_states, noutput_states));
+}
 
-static void insrot(int id, int r)
+static void apply_probe(struct xrandr_snapshot *snap, double start, double ms)
 {
-    Rb_node node;
-        
-    node=rb_inserti(rotations, id, NULL);
-        
-    if(node!=NULL)
-        node->v.ival=r;
+    xrandr_stats_phase(XRANDR_STAT_PROBE, ms);
+    xrandr_trace(XRANDR_TRACE_PROBE, start, ms, 
+                 snap != NULL ? snap->noutputs : -1);
+    
+    if (snap == NULL)
+        return;
+    
+    relayout_round_trips=snap->round_trips;
+    last_reprobed=snap->reprobed;
+    last_queried=TRUE;
+    
+    if (xrandr_get_backend()->x_events) {
+        layout_probed=TRUE;
+        layout_timestamp=snap->timestamp;
+        layout_config_timestamp=snap->config_timestamp;
+        layout_monitors=snap->has_monitors;
+        if(snap->res!=NULL)
+            output_states_probed(snap);
+    }
+    
+    if (apply_snapshot(snap))
+        save_topology();
 }
 
-static WRegion *getexistingscreen(WMPlex *mplex, int index)
+/*
+ * Put a WScreen on each monitor, probing in the main loop. A full hardware
+ * reprobe is only done if reprobe is set, otherwise the server's cached 
+ * configuration is used.
+ */
+static void probe_screens(bool reprobe)
 {
-    WMPlexIterTmp tmp;
-    WRegion *reg;
-    int current_idx = 0;
-    FOR_ALL_MANAGED_BY_MPLEX(mplex, reg, tmp){
-        if (index == current_idx) {
-            fprintf(stderr, "Is a %s\n", ((Obj*)reg)->obj_type->name);
-            return reg;
+    struct xrandr_snapshot *snap=NULL;
+    double t0;
+    
+    t0=xrandr_stats_now();
+    
+    if(monitors_enough(reprobe)){
+        snap=xrandr_probe_monitors(ioncore_g.dpy);
+        if(snap!=NULL && !complete_snapshot(snap)){
+            xrandr_snapshot_free(snap);
+            snap=NULL;
         }
-        current_idx++;
     }
-    return NULL;
+    
+    if(snap==NULL)
+        snap=xrandr_probe(ioncore_g.dpy, reprobe);
+    
+    apply_probe(snap, t0, xrandr_stats_now()-t0);
 }
 
 /*
- * Put a WScreen on each monitor
+ * As probe_screens, but the X server is probed on the probe thread if 
+ * there is one, and the screens are laid out when the snapshot comes in.
  */
-void init_screens()
+void init_screens(bool reprobe)
 {
-    int screencount;
-    int screennr;
-    int existingscreencount = 0;
-    WRootWin* rootWin = ioncore_g.rootwins;
-    struct xrandr_output_info** output_infos = xrandr_init(ioncore_g.dpy, "ion display", &screencount);
-    WMPlexIterTmp tmp;
-    WRegion *reg;
+    if (xrandr_get_backend()->x_events && 
+        xrandr_worker_probe(reprobe, monitors_enough(reprobe))) {
+        probe_pending=TRUE;
+        return;
+    }
+    
+    probe_screens(reprobe);
+}
+
+/*
+ * Relayout from the outputs patched by RRNotify events, unless they
+ * did not tell enough and the server must be queried. The events do not
+ * describe the topology of backends other than the X server.
+ */
+void update_screens(bool reprobe)
+{
+    struct xrandr_snapshot *snap;
     
-    if (output_infos == NULL)
+    if(reprobe || need_query || delta==NULL || 
+       !xrandr_get_backend()->x_events){
+        init_screens(reprobe);
         return;
+    }
+    
+    /* the patched snapshot is handed over, and patching starts anew 
+     * from a copy of it */
+    snap=delta;
+    delta=NULL;
+    
+    last_reprobed=FALSE;
+    last_queried=FALSE;
+    
+    if(apply_snapshot(snap))
+        save_topology();
+}
 
-    fprintf(stderr, "screen count: %d\n", screencount);
+static void relayout_finish()
+{
+    /* the initial layout is not a relayout */
+    if(burst_start<0)
+        return;
+    
+    if(outputs_changed){
+        outputs_changed=FALSE;
+        xrandr_profiles_hotplug();
+    }
+    
+    xrandr_stats_phase(XRANDR_STAT_TOTAL, xrandr_stats_now()-burst_start);
+    xrandr_trace(XRANDR_TRACE_RELAYOUT, burst_start, 
+                 xrandr_stats_now()-burst_start, last_absorbed);
+    xrandr_stats_relayout(relayout_round_trips, relayout_screens_touched);
+    burst_start=-1;
+}
 
-    FOR_ALL_MANAGED_BY_MPLEX(&rootWin->scr.mplex, reg, tmp){
-        existingscreencount++;
-        fprintf(stderr, "One managed before at %p\n", (void*)reg);
+/*
+ * Run the relayout for all change events received since the last one.
+ */
+void xrandr_relayout(bool reprobe)
+{
+    double start=xrandr_stats_now();
+    
+    if(relayout_timer!=NULL)
+        timer_reset(relayout_timer);
+    
+    /* the probe in progress may have missed the changes */
+    if(probe_pending){
+        relayout_again=TRUE;
+        reprobe_again=reprobe_again || reprobe;
+        return;
     }
 
-    /* disregard the last one - this is probably the hidden root screen? */
-    if (existingscreencount > 0)
-        existingscreencount--;
+    last_absorbed=pending_events;
+    pending_events=0;
+    relayout_count++;
+    relayout_round_trips=0;
+    relayout_screens_touched=0;
+    
+    if(burst_start>=0)
+        xrandr_stats_phase(XRANDR_STAT_EVENT, start-burst_start);
+    else
+        burst_start=start;
 
-    for (screennr = 0; screennr < screencount; screennr++){
-        struct xrandr_output_info* output_info = output_infos[screennr];
-
-        WFitParams fp;
-        fp.g.x = output_info->x;
-        fp.g.y = output_info->y;
-        fp.g.w = output_info->w;
-        fp.g.h = output_info->h;
-        fp.mode = REGION_FIT_EXACT;
-        fprintf(stderr, "Size: %d x %d at %d x %d\n", fp.g.w, fp.g.h, fp.g.x, fp.g.y);
-        
-        if (screennr < existingscreencount) {
-            WRegion *existingscreen = getexistingscreen(&rootWin->scr.mplex, screennr);
-            /* the screen sizes are likely stable, but we need to reposition 
-             * the existing screen anyway because the order and thus the 
-             * might have changed */
-            fprintf(stderr, "One existing screen %d\n", screennr);
-
-            /* for some reason this does not appear to have any effect? */
-            REGION_GEOM(existingscreen)=fp.g;
-            mplex_managed_geom((WMPlex*)existingscreen, &(fp.g));
-            mplex_do_fit_managed((WMPlex*)existingscreen, &fp);
-        } else {
-            WScreen* newScreen;
-            WMPlexAttachParams par = MPLEXATTACHPARAMS_INIT;
-            fprintf(stderr, "One new screen %d\n", screennr);
-    
-            par.flags = MPLEX_ATTACH_GEOM|MPLEX_ATTACH_SIZEPOLICY|MPLEX_ATTACH_UNNUMBERED;
-            par.geom = fp.g;
-            par.szplcy = SIZEPOLICY_FULL_EXACT;
-
-            newScreen = (WScreen*) mplex_do_attach_new(&rootWin->scr.mplex, &par,
-                (WRegionCreateFn*)create_screen, NULL);
-            newScreen->id = screennr;
-        }
+    update_screens(reprobe);
+    
+    if(!probe_pending)
+        relayout_finish();
+}
+
+/*
+ * A snapshot from the probe thread is in. The relayout waiting for it is
+ * finished, and the ones asked for meanwhile are run.
+ */
+void xrandr_probe_done(struct xrandr_snapshot *snap, double start, double ms)
+{
+    bool reprobe=reprobe_again;
+    
+    if(!probe_pending){
+        xrandr_snapshot_free(snap);
+        return;
+    }
+    
+    probe_pending=FALSE;
+    
+    /* the server is no longer what is laid out */
+    if(!xrandr_get_backend()->x_events){
+        xrandr_snapshot_free(snap);
+        snap=NULL;
+    }
+    
+    if(snap!=NULL && !complete_snapshot(snap)){
+        /* the crtcs and outputs are walked after all */
+        xrandr_snapshot_free(snap);
+        walk_outputs=TRUE;
+        init_screens(FALSE);
+        if(probe_pending)
+            return;
+    }else{
+        apply_probe(snap, start, ms);
+    }
+    
+    relayout_finish();
+    
+    if(relayout_again){
+        relayout_again=FALSE;
+        reprobe_again=FALSE;
+        /* the probe may be older than the events, or newer */
+        walk_outputs=TRUE;
+        /* the events received meanwhile patched the old snapshot */
+        need_query=TRUE;
+        xrandr_relayout(reprobe);
     }
+}
+
+/* the screens are there already, so the probe need not hold anything up */
+static void deferred_init(Obj *obj)
+{
+    init_screens(TRUE);
+}
 
-    FOR_ALL_MANAGED_BY_MPLEX(&rootWin->scr.mplex, reg, tmp){
-        existingscreencount++;
-        fprintf(stderr, "One now managed at %p\n", (void*)reg);
+static void relayout_timer_handler(WTimer *timer, Obj *obj)
+{
+    xrandr_relayout(FALSE);
+}
+
+/*
+ * Mark the topology dirty. Docking typically produces a burst of change 
+ * events; the timer is re-armed on each of them so that only one relayout
+ * runs once the burst has settled.
+ */
+void xrandr_schedule_relayout()
+{
+    if(pending_events==0)
+        burst_start=xrandr_stats_now();
+    pending_events++;
+    xrandr_stats_event();
+    
+    if(relayout_delay<=0 || relayout_timer==NULL){
+        xrandr_relayout(FALSE);
+        return;
     }
-    mplex_fit_managed(&rootWin->scr.mplex);
+    
+    timer_set(relayout_timer, relayout_delay, 
+              (WTimerHandler*)relayout_timer_handler, NULL);
+}
 
-    rootWin->scr.id = -2;
+static void delta_remove(int i)
+{
+    delta->noutputs--;
+    memmove(delta->outputs+i, delta->outputs+i+1, 
+            (delta->noutputs-i)*sizeof(struct xrandr_output_info));
 }
 
-void update_screens()
+/* size of a w x h mode shown with rotation r */
+static void rotated_size(Rotation r, int w, int h, int *rw, int *rh)
 {
-    init_screens();
+    if(r&(RR_Rotate_90|RR_Rotate_270)){
+        *rw=h;
+        *rh=w;
+    }else{
+        *rw=w;
+        *rh=h;
+    }
 }
 
-bool handle_xrandr_event(XEvent *ev)
+/*
+ * The crtc event carries the new geometry of all outputs on the crtc. 
+ */
+static void handle_crtc_change(XRRCrtcChangeNotifyEvent *cev)
 {
-    if(hasXrandR && ev->type == xrr_event_base + RRScreenChangeNotify) {
-        XRRScreenChangeNotifyEvent *rev=(XRRScreenChangeNotifyEvent *)ev;
+    bool found=FALSE;
+    int i;
+    
+    gamma_cache_invalidate(cev->crtc);
+    crtc_state_set(cev->crtc, cev->mode, cev->rotation);
+    
+    if(need_query || delta==NULL)
+        return;
+    
+    for(i=0; i<delta->noutputs; ){
+        struct xrandr_output_info *o=&delta->outputs[i];
         
-        WFitParams fp;
-        WScreen *screen;
-        bool pivot=FALSE;
-
-        update_screens();
-        /* for now stop here - we probably don't need the original code below anymore */
-        return TRUE;
+        if(o->crtc!=cev->crtc){
+            i++;
+            continue;
+        }
         
-        screen=XWINDOW_REGION_OF_T(rev->root, WScreen);
+        found=TRUE;
         
-        if(screen!=NULL){
-            int r;
-            Rb_node node;
-            int found;
-            
-            r=rr2scrrot(rev->rotation);
-            
-            fp.g.x=REGION_GEOM(screen).x;
-            fp.g.y=REGION_GEOM(screen).y;
-            
-            if(rev->rotation==RR_Rotate_90 || rev->rotation==RR_Rotate_270){
-                fp.g.w=rev->height;
-                fp.g.h=rev->width;
-            }else{
-                fp.g.w=rev->width;
-                fp.g.h=rev->height;
-            }
-            
-            fp.mode=REGION_FIT_EXACT;
-            
-            node=rb_find_ikey_n(rotations, screen->id, &found);
+        if(cev->mode==None){
+            delta_remove(i);
+            continue;
+        }
+        
+        /* the refresh rate of another mode is not known here */
+        if(cev->mode!=o->mode){
+            need_query=TRUE;
+            return;
+        }
+        
+        /* 
+         * The event has the size of the mode, neither rotated nor scaled.
+         * A scaled or transformed output keeps the size it was probed 
+         * with; if it is rotated, its new size has to be queried.
+         */
+        if(cev->rotation!=o->rotation){
+            int w, h;
             
-            if(!found){
-                insrot(screen->id, r);
-            }else if(r!=node->v.ival){
-                int or=node->v.ival;
-                
-                fp.mode|=REGION_FIT_ROTATE;
-                fp.rotation=(r>or
-                             ? SCREEN_ROTATION_0+r-or
-                             : (SCREEN_ROTATION_270+1)+r-or);
-                node->v.ival=r;
+            rotated_size(o->rotation, cev->width, cev->height, &w, &h);
+            if(w!=o->w || h!=o->h){
+                need_query=TRUE;
+                return;
             }
-            
-            REGION_GEOM(screen)=fp.g;
-            
-            mplex_managed_geom((WMPlex*)screen, &(fp.g));
-            
-            mplex_do_fit_managed((WMPlex*)screen, &fp);
+            rotated_size(cev->rotation, cev->width, cev->height, 
+                         &o->w, &o->h);
+        }
+        
+        o->x=cev->x;
+        o->y=cev->y;
+        o->rotation=cev->rotation;
+        i++;
+    }
+    
+    /* 
+     * A crtc that was not in use has outputs we know nothing about. One
+     * that is in use but not known drives part of a monitor made of
+     * several crtcs, which only a query tells about.
+     */
+    if(!found && (cev->mode!=None || layout_monitors))
+        need_query=TRUE;
+}
+
+/*
+ * Outputs that go away can be dropped. Outputs that appear need their
+ * name and geometry, which the event does not tell. Neither does it tell
+ * what changed about an output that stays: it may have moved to another
+ * crtc, or become primary or stopped being so.
+ */
+static void handle_output_change(XRROutputChangeNotifyEvent *oev)
+{
+    bool gone=(oev->connection!=RR_Connected || oev->crtc==None || 
+               oev->mode==None);
+    int i;
+    
+    outputs_changed=TRUE;
+    output_state_set(oev->output, oev->crtc, 
+                     (oev->connection==RR_Connected ? oev->mode : None),
+                     oev->rotation);
+    
+    /* profiles are matched against a probe */
+    if(xrandr_have_profiles())
+        need_query=TRUE;
+    
+    if(need_query || delta==NULL)
+        return;
+    
+    for(i=0; i<delta->noutputs; i++){
+        struct xrandr_output_info *o=&delta->outputs[i];
+        
+        if(o->id!=oev->output)
+            continue;
+        
+        if(gone)
+            delta_remove(i);
+        else
+            need_query=TRUE;
+        return;
+    }
+    
+    if(!gone)
+        need_query=TRUE;
+}
+
+bool handle_xrandr_event(XEvent *ev)
+{
+    if(hasXrandR && ev->type == xrr_event_base + RRNotify) {
+        XRRNotifyEvent *nev=(XRRNotifyEvent*)ev;
+        
+        xrandr_trace(XRANDR_TRACE_EVENT, xrandr_stats_now(), -1, nev->subtype);
+        
+        if(nev->subtype==RRNotify_CrtcChange)
+            handle_crtc_change((XRRCrtcChangeNotifyEvent*)ev);
+        else if(nev->subtype==RRNotify_OutputChange)
+            handle_output_change((XRROutputChangeNotifyEvent*)ev);
+        else
+            return TRUE;
+        
+        xrandr_schedule_relayout();
+        return TRUE;
+    }
+    
+    if(hasXrandR && ev->type == xrr_event_base + RRScreenChangeNotify) {
+        /* Keep Xlib's idea of the display size up to date. The outputs 
+         * themselves, including their rotation, are reported by the 
+         * RRNotify events. */
+        XRRScreenChangeNotifyEvent *sce=(XRRScreenChangeNotifyEvent*)ev;
+        
+        XRRUpdateConfiguration(ev);
+        
+        xrandr_trace(XRANDR_TRACE_EVENT, xrandr_stats_now(), -1, -1);
+        
+        /* 
+         * Nothing was set since the last probe: the same configuration
+         * was applied again, or the event is about something else such 
+         * as DPMS. 
+         */
+        if(layout_probed && !need_query &&
+           sce->timestamp==layout_timestamp &&
+           sce->config_timestamp==layout_config_timestamp){
+            skipped_events++;
+            return TRUE;
         }
         
+        /* 
+         * Monitors added or removed with xrandr --setmonitor send no
+         * RRNotify events, so the monitor list has to be asked for.
+         */
+        if(layout_monitors)
+            need_query=TRUE;
+
+        xrandr_schedule_relayout();
         return TRUE;
     }
     return FALSE;
@@ -228,45 +1538,275 @@ bool handle_xrandr_event(XEvent *ev)
 
 
 
-static bool check_pivots()
+/*EXTL_DOC
+ * Set module configuration. The following are supported:
+ * 
+ * \begin{tabularx}{\linewidth}{lX}
+ *  \tabhead{Field & Description}
+ *  \var{relayout_delay} & Quiet period in milliseconds after the last 
+ *                          screen change event before the screens are 
+ *                          relayouted. Zero relayouts on every event. \\
+ * \end{tabularx}
+ */
+EXTL_EXPORT
+void mod_xrandr_set(ExtlTab tab)
+{
+    int d;
+    
+    if(extl_table_gets_i(tab, "relayout_delay", &d))
+        relayout_delay=(d<0 ? 0 : d);
+}
+
+
+/*EXTL_DOC
+ * Get module configuration and relayout statistics. Besides the fields 
+ * accepted by \fnref{mod_xrandr.set}, the table contains \var{relayouts},
+ * the number of relayouts done, \var{last_absorbed}, the number of 
+ * change events the last relayout handled, \var{last_reprobed}, 
+ * which is set if the last relayout did a full hardware reprobe, and
+ * \var{last_round_trips}, the number of times its probe waited for the
+ * X server. \var{last_queried} is not set if the last relayout was done
+ * from the contents of the change events alone. \var{skipped_events} 
+ * counts screen change events dropped because nothing had been set since
+ * the last probe, and \var{skipped_relayouts} relayouts that found the 
+ * outputs as they were and left the screens alone.
+ */
+EXTL_SAFE
+EXTL_EXPORT
+ExtlTab mod_xrandr_get()
 {
-    WScreen *scr;
-    XRRScreenConfiguration *cfg;
+    ExtlTab tab=extl_create_table();
     
-    rotations=make_rb();
+    extl_table_sets_i(tab, "relayout_delay", relayout_delay);
+    extl_table_sets_i(tab, "relayouts", relayout_count);
+    extl_table_sets_i(tab, "last_absorbed", last_absorbed);
+    extl_table_sets_b(tab, "last_reprobed", last_reprobed);
+    extl_table_sets_b(tab, "last_queried", last_queried);
+    extl_table_sets_i(tab, "last_round_trips", xrandr_round_trips());
+    extl_table_sets_i(tab, "skipped_events", skipped_events);
+    extl_table_sets_i(tab, "skipped_relayouts", skipped_relayouts);
     
-    if(rotations==NULL)
-        return FALSE;
+    return tab;
+}
+
+
+/*EXTL_DOC
+ * List the active outputs as of the last relayout, without asking the 
+ * X server. Each entry is a table with the fields \var{name} (of the 
+ * connector), \var{x}, \var{y}, \var{w}, \var{h}, \var{rotation} in 
+ * degrees, \var{refresh} in Hz, \var{mm_width} and \var{mm_height} 
+ * (the physical size, 0 if unknown), \var{primary} and \var{screen}, 
+ * the \type{WScreen} on the output.
+ */
+EXTL_SAFE
+EXTL_EXPORT
+ExtlTab mod_xrandr_outputs()
+{
+    ExtlTab tab=extl_create_table();
+    int i;
     
-    FOR_ALL_SCREENS(scr){
-        Rotation rot=RR_Rotate_90;
-        
-        /* XRRRotations appears to segfault on other screens (id's -2 (the 
-         * invisible root screen) and 1 (the second monitor)), on which 
-         */
-        if (scr->id == 0){
-            XRRRotations(ioncore_g.dpy, scr->id, &rot);
-            insrot(scr->id, rr2scrrot(rot));
-        }
+    if(snapshot==NULL)
+        return tab;
+    
+    for(i=0; i<snapshot->noutputs; i++){
+        ExtlTab otab=output_table(&snapshot->outputs[i]);
+        extl_table_seti_t(tab, i+1, otab);
+        extl_unref_table(otab);
     }
     
-    return TRUE;
+    return tab;
+}
+
+
+/*EXTL_DOC
+ * Get the screen on the output (connector) \var{name}, or nil if the 
+ * output is not active.
+ */
+EXTL_SAFE
+EXTL_EXPORT
+WScreen *mod_xrandr_screen_for_output(const char *name)
+{
+    const struct xrandr_output_info *o=find_output_info(name);
+    
+    return (o!=NULL ? screen_of_output(o) : NULL);
+}
+
+
+/*EXTL_DOC
+ * Get the primary output in the format of \fnref{mod_xrandr.outputs}, or 
+ * nil if there is none.
+ */
+EXTL_SAFE
+EXTL_EXPORT
+ExtlTab mod_xrandr_primary()
+{
+    int i;
+    
+    if(snapshot==NULL)
+        return extl_table_none();
+    
+    for(i=0; i<snapshot->noutputs; i++){
+        if(snapshot->outputs[i].primary)
+            return output_table(&snapshot->outputs[i]);
+    }
+    
+    return extl_table_none();
+}
+
+
+/*EXTL_DOC
+ * Make the X server reprobe all outputs (reading the EDID of every 
+ * connector) and relayout the screens immediately. Change events only
+ * use the configuration the server already knows about, so this is
+ * needed if a monitor change went unnoticed.
+ */
+EXTL_EXPORT
+void mod_xrandr_reprobe()
+{
+    if(hasXrandR)
+        xrandr_relayout(TRUE);
+}
+
+
+/*EXTL_DOC
+ * Get the gamma correction of the monitor on output \var{name}, as a 
+ * table with the fields \var{red}, \var{green}, \var{blue} and
+ * \var{brightness}, like \command{xrandr --verbose} reports them, and 
+ * \var{size}, the number of entries in the gamma ramps. The ramps are 
+ * read from the server on the first call and again only after the 
+ * output's crtc has changed. Returns nil if the output is not active.
+ */
+EXTL_SAFE
+EXTL_EXPORT
+ExtlTab mod_xrandr_gamma(const char *name)
+{
+    const struct xrandr_output_info *o;
+    struct xrandr_gamma *gamma=NULL;
+    ExtlTab tab;
+    
+    if(!hasXrandR || !xrandr_get_backend()->x_events)
+        return extl_table_none();
+    
+    o=find_output_info(name);
+    
+    if(o!=NULL && o->crtc!=None)
+        gamma=gamma_cache_get(o->crtc);
+    
+    if(gamma==NULL)
+        return extl_table_none();
+    
+    tab=extl_create_table();
+    extl_table_sets_d(tab, "red", gamma->red);
+    extl_table_sets_d(tab, "green", gamma->green);
+    extl_table_sets_d(tab, "blue", gamma->blue);
+    extl_table_sets_d(tab, "brightness", gamma->brightness);
+    extl_table_sets_i(tab, "size", gamma->size);
+    
+    return tab;
 }
 
 
+/*EXTL_DOC
+ * Get the transform of the monitor on output \var{name}, as a table with
+ * \var{matrix}, the 3x3 transformation matrix as a list of rows, and 
+ * \var{panning}, the panning area (\var{x}, \var{y}, \var{w}, \var{h}) if
+ * the output pans. Scaled outputs show the scaling factors on the 
+ * diagonal of the matrix. Returns nil if the output is not active.
+ */
+EXTL_SAFE
+EXTL_EXPORT
+ExtlTab mod_xrandr_transform(const char *name)
+{
+    XTransform transform;
+    XRRPanning panning;
+    Bool has_panning=False;
+    const struct xrandr_output_info *o;
+    ExtlTab tab, matrix;
+    RRCrtc crtc=None;
+    int i, j;
+    
+    if(!hasXrandR || !xrandr_get_backend()->x_events)
+        return extl_table_none();
+    
+    o=find_output_info(name);
+    
+    if(o!=NULL)
+        crtc=o->crtc;
+    
+    if(crtc==None || 
+       !xrandr_crtc_transform(ioncore_g.dpy, crtc, &transform, &panning,
+                              &has_panning)){
+        return extl_table_none();
+    }
+    
+    tab=extl_create_table();
+    matrix=extl_create_table();
+    
+    for(i=0; i<3; i++){
+        ExtlTab row=extl_create_table();
+        for(j=0; j<3; j++)
+            extl_table_seti_d(row, j+1, XFixedToDouble(transform.matrix[i][j]));
+        extl_table_seti_t(matrix, i+1, row);
+        extl_unref_table(row);
+    }
+    extl_table_sets_t(tab, "matrix", matrix);
+    extl_unref_table(matrix);
+    
+    if(has_panning){
+        ExtlTab pan=extl_create_table();
+        extl_table_sets_i(pan, "x", panning.left);
+        extl_table_sets_i(pan, "y", panning.top);
+        extl_table_sets_i(pan, "w", panning.width);
+        extl_table_sets_i(pan, "h", panning.height);
+        extl_table_sets_t(tab, "panning", pan);
+        extl_unref_table(pan);
+    }
+    
+    return tab;
+}
+
 
 bool mod_xrandr_init()
 {
     hasXrandR=
         XRRQueryExtension(ioncore_g.dpy,&xrr_event_base,&xrr_error_base);
         
-    if(!check_pivots())
+    relayout_timer=create_timer();
+    
+    if(relayout_timer==NULL)
+        return FALSE;
+    
+    output_screens=make_rb();
+    
+    if(output_screens==NULL)
+        return FALSE;
+    
+    xrandr_layout_changed_hook=mainloop_register_hook(
+        "xrandr_layout_changed_hook", create_hook());
+    
+    if(xrandr_layout_changed_hook==NULL)
+        return FALSE;
+    
+    if(!mod_xrandr_register_exports())
         return FALSE;
     
     if(hasXrandR){
         XRRSelectInput(ioncore_g.dpy,ioncore_g.rootwins->dummy_win,
-                       RRScreenChangeNotifyMask);
-        init_screens();
+                       RRScreenChangeNotifyMask|RRCrtcChangeNotifyMask|
+                       RROutputChangeNotifyMask);
+        /* only the probes of later changes are done on the thread */
+        xrandr_worker_init(ioncore_g.dpy);
+        
+        /* 
+         * The screens must be there before the saved workspaces are
+         * loaded. With a saved layout, they are at once and the probe 
+         * that confirms them is done on the probe thread once the window
+         * manager is up.
+         */
+        if(load_topology())
+            mainloop_defer_action(NULL, deferred_init);
+        else
+            probe_screens(TRUE);
     }else{
         warn_obj("mod_xrandr","XRandR is not supported on this display");
     }
@@ -282,5 +1822,42 @@ bool mod_xrandr_deinit()
     hook_remove(ioncore_handle_event_alt,
                 (WHookDummy *)handle_xrandr_event);
     
+    xrandr_worker_deinit();
+    probe_pending=FALSE;
+    relayout_again=FALSE;
+    reprobe_again=FALSE;
+    
+    xrandr_fake_deinit();
+    xrandr_profiles_deinit();
+    xrandr_record_deinit();
+    
+    if(relayout_timer!=NULL){
+        destroy_obj((Obj*)relayout_timer);
+        relayout_timer=NULL;
+    }
+    
+    xrandr_snapshot_free(delta);
+    delta=NULL;
+    xrandr_snapshot_free(snapshot);
+    snapshot=NULL;
+    need_query=TRUE;
+    layout_probed=FALSE;
+    layout_monitors=FALSE;
+    noutput_states=0;
+    walk_outputs=TRUE;
+    
+    unpark_all_screens();
+    free_output_screens();
+    free_gamma_cache();
+    
+    mod_xrandr_unregister_exports();
+    
+    if(xrandr_layout_changed_hook!=NULL){
+        mainloop_unregister_hook("xrandr_layout_changed_hook",
+                                 xrandr_layout_changed_hook);
+        destroy_obj((Obj*)xrandr_layout_changed_hook);
+        xrandr_layout_changed_hook=NULL;
+    }
+    
     return TRUE;
 }
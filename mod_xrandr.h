@@ -0,0 +1,61 @@
+/*
+ * Ion xrandr module
+ *
+ * See the README for copyright information.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License,or (at your option) any later version.
+ */
+
+#ifndef ION_MOD_XRANDR_MOD_XRANDR_H
+#define ION_MOD_XRANDR_MOD_XRANDR_H
+
+#include <X11/Xlib.h>
+#include <X11/extensions/Xrandr.h>
+
+#include <ioncore/common.h>
+#include <libmainloop/hooks.h>
+#include <libextl/extl.h>
+#include "xrandr.h"
+
+extern WHook *xrandr_layout_changed_hook;
+
+/** relayout the screens now, with a full hardware reprobe if reprobe is set */
+extern void xrandr_relayout(bool reprobe);
+
+/** relayout once the current burst of changes has settled */
+extern void xrandr_schedule_relayout();
+
+/** lay out a snapshot made by the probe thread, which took ms from start */
+extern void xrandr_probe_done(struct xrandr_snapshot *snap, double start, 
+                              double ms);
+
+/** the outputs the screens were last laid out for */
+extern struct xrandr_snapshot *xrandr_current_snapshot();
+
+/** true while a relayout waits for the probe thread */
+extern bool xrandr_probe_in_progress();
+
+/** RandR rotation for an angle in degrees, or 0 if there is none */
+extern Rotation xrandr_rotation(int degrees);
+
+/** angle in degrees of a RandR rotation */
+extern int xrandr_rotation_degrees(Rotation r);
+
+/** 
+ * Parse a list of output tables as accepted by mod_xrandr.apply. Returns
+ * a new array with *n entries, or NULL if tab is invalid.
+ */
+extern struct xrandr_output_config *xrandr_layout_from_table(ExtlTab tab, 
+                                                             int *n);
+
+/** apply the first profile matching the connected outputs */
+extern void xrandr_profiles_hotplug();
+
+extern bool xrandr_have_profiles();
+
+extern void xrandr_profiles_deinit();
+
+#endif /* ION_MOD_XRANDR_MOD_XRANDR_H */
@@ -0,0 +1,140 @@
+/*
+ * Ion xrandr module
+ *
+ * See the README for copyright information.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License,or (at your option) any later version.
+ */
+
+/*
+ * Recording of the topologies laid out, as a Lua file that evaluates to
+ * a list of steps. Each step has the outputs in the format of the fake 
+ * topologies, so a recording can be replayed through the layout code 
+ * with mod_xrandr.replay.
+ */
+
+#include <stdio.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/Xrandr.h>
+
+#include <ioncore/common.h>
+#include <libextl/extl.h>
+
+#include "xrandr.h"
+#include "stats.h"
+#include "mod_xrandr.h"
+#include "record.h"
+
+
+static FILE *record_file=NULL;
+static double record_start=0;
+static int record_steps=0;
+
+
+static void write_string(FILE *f, const char *s)
+{
+    putc('"', f);
+    for(; *s!='\0'; s++){
+        if(*s=='"' || *s=='\\')
+            putc('\\', f);
+        if((unsigned char)*s<' ')
+            fprintf(f, "\\%03d", (unsigned char)*s);
+        else
+            putc(*s, f);
+    }
+    putc('"', f);
+}
+
+
+void xrandr_record_snapshot(const struct xrandr_snapshot *snap, int events)
+{
+    int i;
+    
+    if(record_file==NULL)
+        return;
+    
+    fprintf(record_file, "{ time=%.3f, events=%d, timestamp=%lu, "
+            "config_timestamp=%lu, outputs={\n",
+            xrandr_stats_now()-record_start, events,
+            (unsigned long)snap->timestamp, 
+            (unsigned long)snap->config_timestamp);
+    
+    for(i=0; i<snap->noutputs; i++){
+        const struct xrandr_output_info *o=&snap->outputs[i];
+        
+        fprintf(record_file, "    { name=");
+        write_string(record_file, o->name);
+        fprintf(record_file, ", x=%d, y=%d, w=%d, h=%d, rotation=%d, "
+                "refresh=%.3f, mm_width=%lu, mm_height=%lu, primary=%s,\n"
+                "      id=%lu, crtc=%lu, mode=%lu },\n",
+                o->x, o->y, o->w, o->h, xrandr_rotation_degrees(o->rotation),
+                o->refresh, o->mm_width, o->mm_height, 
+                (o->primary ? "true" : "false"),
+                (unsigned long)o->id, (unsigned long)o->crtc, 
+                (unsigned long)o->mode);
+    }
+    
+    fprintf(record_file, "} },\n");
+    fflush(record_file);
+    record_steps++;
+}
+
+
+/*EXTL_DOC
+ * Record every topology laid out from now on, with the time since the 
+ * recording started and the number of change events that led to it, to 
+ * \var{file}. The file is a Lua script returning the list of steps, for
+ * \fnref{mod_xrandr.replay}. Returns false if \var{file} cannot be 
+ * written.
+ */
+EXTL_EXPORT
+bool mod_xrandr_record_start(const char *file)
+{
+    FILE *f;
+    
+    f=fopen(file, "w");
+    
+    if(f==NULL){
+        warn_err_obj(file);
+        return FALSE;
+    }
+    
+    xrandr_record_deinit();
+    
+    record_file=f;
+    record_start=xrandr_stats_now();
+    record_steps=0;
+    
+    fprintf(record_file, "-- mod_xrandr topology recording\nreturn {\n");
+    
+    return TRUE;
+}
+
+
+/*EXTL_DOC
+ * Stop recording and return the number of steps recorded.
+ */
+EXTL_EXPORT
+int mod_xrandr_record_stop()
+{
+    int steps=record_steps;
+    
+    xrandr_record_deinit();
+    
+    return steps;
+}
+
+
+void xrandr_record_deinit()
+{
+    if(record_file==NULL)
+        return;
+    
+    fprintf(record_file, "}\n");
+    fclose(record_file);
+    record_file=NULL;
+    record_steps=0;
+}
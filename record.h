@@ -0,0 +1,23 @@
+/*
+ * Ion xrandr module
+ *
+ * See the README for copyright information.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License,or (at your option) any later version.
+ */
+
+#ifndef ION_MOD_XRANDR_RECORD_H
+#define ION_MOD_XRANDR_RECORD_H
+
+#include "xrandr.h"
+
+/** add snap, laid out after events change events, to the recording */
+extern void xrandr_record_snapshot(const struct xrandr_snapshot *snap,
+                                   int events);
+
+extern void xrandr_record_deinit();
+
+#endif /* ION_MOD_XRANDR_RECORD_H */
@@ -0,0 +1,164 @@
+/*
+ * Ion xrandr module
+ *
+ * See the README for copyright information.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License,or (at your option) any later version.
+ */
+
+#include <time.h>
+
+#include <ioncore/common.h>
+#include <libextl/extl.h>
+
+#include "stats.h"
+
+/*
+ * Latencies are kept in histograms with logarithmic buckets: bucket i
+ * counts samples below 2^i microseconds (and not in bucket i-1), so 
+ * percentiles are exact to a factor of two with constant memory.
+ */
+#define NBUCKETS 32
+
+typedef struct{
+    unsigned long count;
+    double total_ms;
+    double max_ms;
+    unsigned long buckets[NBUCKETS];
+} PhaseStats;
+
+static const char *phase_names[XRANDR_STAT_NPHASES]={
+    "event", "probe", "diff", "attach", "fit", "total"
+};
+
+static PhaseStats phases[XRANDR_STAT_NPHASES];
+static unsigned long n_events=0;
+static unsigned long n_relayouts=0;
+static unsigned long n_round_trips=0;
+static unsigned long n_screens_touched=0;
+
+
+double xrandr_stats_now()
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000.0+ts.tv_nsec/1000000.0;
+}
+
+
+static int bucket_of(double ms)
+{
+    double us=ms*1000.0;
+    int i=0;
+    
+    while(i<NBUCKETS-1 && us>=(double)(1UL<<i))
+        i++;
+    
+    return i;
+}
+
+
+void xrandr_stats_phase(int phase, double ms)
+{
+    PhaseStats *st;
+    
+    if(phase<0 || phase>=XRANDR_STAT_NPHASES)
+        return;
+    
+    if(ms<0)
+        ms=0;
+    
+    st=&phases[phase];
+    st->count++;
+    st->total_ms+=ms;
+    if(ms>st->max_ms)
+        st->max_ms=ms;
+    st->buckets[bucket_of(ms)]++;
+}
+
+
+void xrandr_stats_event()
+{
+    n_events++;
+}
+
+
+void xrandr_stats_relayout(int round_trips, int screens_touched)
+{
+    n_relayouts++;
+    n_round_trips+=round_trips;
+    n_screens_touched+=screens_touched;
+}
+
+
+/* Upper bound of the bucket the pct'th percentile falls in, in ms */
+static double percentile(const PhaseStats *st, int pct)
+{
+    unsigned long rank, seen=0;
+    int i;
+    
+    if(st->count==0)
+        return 0;
+    
+    rank=(st->count*pct+99)/100;
+    
+    for(i=0; i<NBUCKETS; i++){
+        seen+=st->buckets[i];
+        if(seen>=rank)
+            break;
+    }
+    
+    if(i>=NBUCKETS-1)
+        return st->max_ms;
+    
+    return (double)(1UL<<i)/1000.0;
+}
+
+
+/*EXTL_DOC
+ * Get hotplug statistics. The table has the counts \var{events}, 
+ * \var{relayouts}, \var{round_trips} and \var{screens_touched}, and a
+ * table \var{phases} with an entry for each of \codestr{event} (waiting 
+ * for the event burst to settle), \codestr{probe}, \codestr{diff}, 
+ * \codestr{attach}, \codestr{fit} and \codestr{total} (first event to
+ * finished layout). Each has \var{count}, \var{total_ms}, \var{max_ms} 
+ * and the latency percentiles \var{p50}, \var{p95} and \var{p99} in 
+ * milliseconds, exact to a factor of two.
+ */
+EXTL_SAFE
+EXTL_EXPORT
+ExtlTab mod_xrandr_stats()
+{
+    ExtlTab tab=extl_create_table();
+    ExtlTab ptab=extl_create_table();
+    int i;
+    
+    extl_table_sets_i(tab, "events", n_events);
+    extl_table_sets_i(tab, "relayouts", n_relayouts);
+    extl_table_sets_i(tab, "round_trips", n_round_trips);
+    extl_table_sets_i(tab, "screens_touched", n_screens_touched);
+    
+    for(i=0; i<XRANDR_STAT_NPHASES; i++){
+        const PhaseStats *st=&phases[i];
+        ExtlTab t=extl_create_table();
+        
+        extl_table_sets_i(t, "count", st->count);
+        extl_table_sets_d(t, "total_ms", st->total_ms);
+        extl_table_sets_d(t, "max_ms", st->max_ms);
+        extl_table_sets_d(t, "p50", percentile(st, 50));
+        extl_table_sets_d(t, "p95", percentile(st, 95));
+        extl_table_sets_d(t, "p99", percentile(st, 99));
+        
+        extl_table_sets_t(ptab, phase_names[i], t);
+        extl_unref_table(t);
+    }
+    
+    extl_table_sets_t(tab, "phases", ptab);
+    extl_unref_table(ptab);
+    
+    return tab;
+}
@@ -0,0 +1,35 @@
+/*
+ * Ion xrandr module
+ *
+ * See the README for copyright information.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License,or (at your option) any later version.
+ */
+
+#ifndef ION_MOD_XRANDR_STATS_H
+#define ION_MOD_XRANDR_STATS_H
+
+#include <libextl/extl.h>
+
+/* Phases of handling a monitor change */
+enum{
+    XRANDR_STAT_EVENT,  /* first event of a burst until the relayout starts */
+    XRANDR_STAT_PROBE,
+    XRANDR_STAT_DIFF,
+    XRANDR_STAT_ATTACH, /* creating, parking and restoring screens */
+    XRANDR_STAT_FIT,
+    XRANDR_STAT_TOTAL,  /* first event of a burst until the layout is done */
+    XRANDR_STAT_NPHASES
+};
+
+/* monotonic time in milliseconds */
+extern double xrandr_stats_now();
+
+extern void xrandr_stats_phase(int phase, double ms);
+extern void xrandr_stats_event();
+extern void xrandr_stats_relayout(int round_trips, int screens_touched);
+
+#endif /* ION_MOD_XRANDR_STATS_H */
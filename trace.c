@@ -0,0 +1,119 @@
+/*
+ * Ion xrandr module
+ *
+ * See the README for copyright information.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License,or (at your option) any later version.
+ */
+
+/*
+ * The last few hundred things the module did, kept in a ring buffer so 
+ * that recording costs a few stores. They are written out on request in
+ * the Chrome trace event format, for chrome://tracing or Perfetto.
+ */
+
+#include <stdio.h>
+
+#include <ioncore/common.h>
+#include <libextl/extl.h>
+
+#include "trace.h"
+
+#define TRACE_SIZE 1024
+
+typedef struct{
+    double start_ms;
+    double dur_ms;
+    int kind;
+    long arg;
+} TraceRecord;
+
+static const char *kind_names[XRANDR_TRACE_NKINDS]={
+    "event", "probe", "diff", "fit", "rotate", "unpark", "create", "park",
+    "relayout"
+};
+
+static const char *arg_names[XRANDR_TRACE_NKINDS]={
+    "subtype", "outputs", "changes", "screen", "screen", "screen", "screen",
+    "screen", "events"
+};
+
+static TraceRecord ring[TRACE_SIZE];
+/* number of records ever made */
+static unsigned long trace_count=0;
+
+
+void xrandr_trace(int kind, double start_ms, double dur_ms, long arg)
+{
+    TraceRecord *r=&ring[trace_count%TRACE_SIZE];
+    
+    r->start_ms=start_ms;
+    r->dur_ms=dur_ms;
+    r->kind=kind;
+    r->arg=arg;
+    trace_count++;
+}
+
+
+/*EXTL_DOC
+ * Write the last monitor change events, probes, diffs, screen fits and 
+ * relayouts to \var{file} as Chrome trace event JSON, which can be loaded 
+ * into chrome://tracing or Perfetto. Returns false if the file cannot be 
+ * written.
+ */
+EXTL_EXPORT
+bool mod_xrandr_trace_dump(const char *file)
+{
+    unsigned long i, first;
+    bool ok;
+    FILE *f;
+    
+    f=fopen(file, "w");
+    
+    if(f==NULL){
+        warn_err_obj(file);
+        return FALSE;
+    }
+    
+    first=(trace_count>TRACE_SIZE ? trace_count-TRACE_SIZE : 0);
+    
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    
+    for(i=first; i<trace_count; i++){
+        const TraceRecord *r=&ring[i%TRACE_SIZE];
+        
+        fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"xrandr\",\"pid\":1,"
+                "\"tid\":1,\"ts\":%.3f,", 
+                (i==first ? "" : ","), kind_names[r->kind], 
+                r->start_ms*1000.0);
+        
+        if(r->dur_ms<0)
+            fprintf(f, "\"ph\":\"i\",\"s\":\"g\",");
+        else
+            fprintf(f, "\"ph\":\"X\",\"dur\":%.3f,", r->dur_ms*1000.0);
+        
+        fprintf(f, "\"args\":{\"%s\":%ld}}", arg_names[r->kind], r->arg);
+    }
+    
+    fprintf(f, "\n]}\n");
+    
+    ok=!ferror(f);
+    
+    if(fclose(f)!=0)
+        ok=FALSE;
+    
+    return ok;
+}
+
+
+/*EXTL_DOC
+ * Forget everything traced so far.
+ */
+EXTL_EXPORT
+void mod_xrandr_trace_clear()
+{
+    trace_count=0;
+}
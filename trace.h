@@ -0,0 +1,36 @@
+/*
+ * Ion xrandr module
+ *
+ * See the README for copyright information.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License,or (at your option) any later version.
+ */
+
+#ifndef ION_MOD_XRANDR_TRACE_H
+#define ION_MOD_XRANDR_TRACE_H
+
+/* Things recorded in the trace */
+enum{
+    XRANDR_TRACE_EVENT,     /* instant, arg: RRNotify subtype or -1 */
+    XRANDR_TRACE_PROBE,     /* arg: outputs found */
+    XRANDR_TRACE_DIFF,      /* arg: outputs changed */
+    XRANDR_TRACE_FIT,       /* arg: screen id, for all screen steps */
+    XRANDR_TRACE_ROTATE,
+    XRANDR_TRACE_UNPARK,
+    XRANDR_TRACE_CREATE,
+    XRANDR_TRACE_PARK,
+    XRANDR_TRACE_RELAYOUT,  /* arg: events absorbed */
+    XRANDR_TRACE_NKINDS
+};
+
+/* 
+ * Record something that took dur_ms from start_ms (as returned by 
+ * xrandr_stats_now), or happened at start_ms if dur_ms<0. Only to be 
+ * called from the main loop.
+ */
+extern void xrandr_trace(int kind, double start_ms, double dur_ms, long arg);
+
+#endif /* ION_MOD_XRANDR_TRACE_H */
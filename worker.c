@@ -0,0 +1,208 @@
+/*
+ * Ion xrandr module
+ *
+ * See the README for copyright information.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License,or (at your option) any later version.
+ */
+
+/*
+ * Probing thread. A slow server or a connector that takes long to answer
+ * over DDC would otherwise stall the whole window manager. The thread 
+ * probes over a connection of its own and passes finished snapshots 
+ * through a pipe watched by the main loop, where they are laid out.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/Xrandr.h>
+
+#include <libtu/misc.h>
+#include <libmainloop/select.h>
+
+#include <ioncore/common.h>
+#include "xrandr.h"
+#include "stats.h"
+#include "mod_xrandr.h"
+#include "worker.h"
+
+
+/* written to the pipe by the thread */
+typedef struct{
+    struct xrandr_snapshot *snap;
+    double start;
+    double ms;
+} ProbeResult;
+
+
+static pthread_t worker;
+static bool worker_running=FALSE;
+static Display *worker_dpy=NULL;
+static int result_fds[2]={-1, -1};
+
+/* protects the requests below */
+static pthread_mutex_t worker_lock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t worker_wakeup=PTHREAD_COND_INITIALIZER;
+static bool probe_requested=FALSE;
+static bool reprobe_requested=FALSE;
+/* every request since the last probe made do with the monitor list */
+static bool monitors_requested=FALSE;
+static bool worker_quit=FALSE;
+
+
+static void *worker_main(void *arg)
+{
+    pthread_mutex_lock(&worker_lock);
+    
+    for(;;){
+        ProbeResult r;
+        bool reprobe, monitors;
+        
+        while(!probe_requested && !worker_quit)
+            pthread_cond_wait(&worker_wakeup, &worker_lock);
+        
+        if(worker_quit)
+            break;
+        
+        reprobe=reprobe_requested;
+        monitors=monitors_requested;
+        probe_requested=FALSE;
+        reprobe_requested=FALSE;
+        monitors_requested=FALSE;
+        pthread_mutex_unlock(&worker_lock);
+        
+        r.start=xrandr_stats_now();
+        r.snap=NULL;
+        if(monitors)
+            r.snap=xrandr_probe_monitors(worker_dpy);
+        if(r.snap==NULL)
+            r.snap=xrandr_probe_server(worker_dpy, reprobe);
+        r.ms=xrandr_stats_now()-r.start;
+        
+        /* smaller than PIPE_BUF, so written in one piece */
+        if(write(result_fds[1], &r, sizeof(r))!=sizeof(r))
+            xrandr_snapshot_free(r.snap);
+        
+        pthread_mutex_lock(&worker_lock);
+    }
+    
+    pthread_mutex_unlock(&worker_lock);
+    
+    return NULL;
+}
+
+
+static void result_handler(int fd, void *data)
+{
+    ProbeResult r;
+    
+    while(read(fd, &r, sizeof(r))==sizeof(r))
+        xrandr_probe_done(r.snap, r.start, r.ms);
+}
+
+
+static void close_fds()
+{
+    if(result_fds[0]>=0)
+        close(result_fds[0]);
+    if(result_fds[1]>=0)
+        close(result_fds[1]);
+    result_fds[0]=-1;
+    result_fds[1]=-1;
+}
+
+
+bool xrandr_worker_init(Display *dpy)
+{
+    if(worker_running)
+        return TRUE;
+    
+    worker_dpy=XOpenDisplay(DisplayString(dpy));
+    
+    if(worker_dpy==NULL){
+        warn("Cannot open a connection for probing, probing in the "
+             "main loop.");
+        return FALSE;
+    }
+    
+    if(pipe(result_fds)!=0){
+        warn_err();
+        goto fail;
+    }
+    
+    fcntl(result_fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(result_fds[1], F_SETFD, FD_CLOEXEC);
+    fcntl(result_fds[0], F_SETFL, O_NONBLOCK);
+    
+    if(!mainloop_register_input_fd(result_fds[0], NULL, result_handler))
+        goto fail;
+    
+    worker_quit=FALSE;
+    
+    if(pthread_create(&worker, NULL, worker_main, NULL)!=0){
+        warn("Cannot start the probe thread, probing in the main loop.");
+        mainloop_unregister_input_fd(result_fds[0]);
+        goto fail;
+    }
+    
+    worker_running=TRUE;
+    
+    return TRUE;
+    
+fail:
+    close_fds();
+    XCloseDisplay(worker_dpy);
+    worker_dpy=NULL;
+    return FALSE;
+}
+
+
+bool xrandr_worker_probe(bool reprobe, bool monitors)
+{
+    if(!worker_running)
+        return FALSE;
+    
+    pthread_mutex_lock(&worker_lock);
+    monitors_requested=monitors && 
+        (monitors_requested || !probe_requested);
+    probe_requested=TRUE;
+    reprobe_requested=reprobe_requested || reprobe;
+    pthread_cond_signal(&worker_wakeup);
+    pthread_mutex_unlock(&worker_lock);
+    
+    return TRUE;
+}
+
+
+void xrandr_worker_deinit()
+{
+    ProbeResult r;
+    
+    if(!worker_running)
+        return;
+    
+    pthread_mutex_lock(&worker_lock);
+    worker_quit=TRUE;
+    probe_requested=FALSE;
+    pthread_cond_signal(&worker_wakeup);
+    pthread_mutex_unlock(&worker_lock);
+    
+    /* waits for a probe in progress */
+    pthread_join(worker, NULL);
+    worker_running=FALSE;
+    
+    mainloop_unregister_input_fd(result_fds[0]);
+    
+    /* nobody is going to lay these out */
+    while(read(result_fds[0], &r, sizeof(r))==sizeof(r))
+        xrandr_snapshot_free(r.snap);
+    
+    close_fds();
+    XCloseDisplay(worker_dpy);
+    worker_dpy=NULL;
+}
@@ -0,0 +1,35 @@
+/*
+ * Ion xrandr module
+ *
+ * See the README for copyright information.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License,or (at your option) any later version.
+ */
+
+#ifndef ION_MOD_XRANDR_WORKER_H
+#define ION_MOD_XRANDR_WORKER_H
+
+#include <X11/Xlib.h>
+#include <ioncore/common.h>
+
+/** 
+ * start the probe thread, with a connection of its own to the server of 
+ * dpy. Returns FALSE if it cannot be started; probes are then done on the 
+ * main thread. 
+ */
+extern bool xrandr_worker_init(Display *dpy);
+
+extern void xrandr_worker_deinit();
+
+/** 
+ * probe the X server on the probe thread. The snapshot is handed to 
+ * xrandr_probe_done from the main loop. If monitors is set, only the 
+ * monitor list is probed if the server has one (see 
+ * xrandr_probe_monitors). Returns FALSE if there is no probe thread.
+ */
+extern bool xrandr_worker_probe(bool reprobe, bool monitors);
+
+#endif /* ION_MOD_XRANDR_WORKER_H */
@@ -31,18 +31,27 @@
 #include <X11/Xproto.h>
 #include <X11/Xatom.h>
 #include <X11/extensions/Xrandr.h>
+#include <X11/Xlib-xcb.h>
+#include <xcb/randr.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "xrandr.h"
 
 #include "config.h"
 
 static char        *program_name;
-static Display        *dpy;
-static Window        root;
-static int        screen = -1;
+/* 
+ * The connection, and all state below that is not constant, is per thread:
+ * probes are made on a thread of their own and planning on the main one.
+ */
+static __thread Display        *dpy;
+static __thread Window        root;
+static __thread int        screen = -1;
 static Bool        automatic = False;
 
 static char *direction[5] = {
@@ -68,6 +77,8 @@ static const struct {
     { NULL,            0 }
 };
 
+#ifdef XRANDR_BENCH
+/* only the benchmark may exit, the module reports failures instead */
 static void
 fatal (const char *format, ...)
 {
@@ -80,6 +91,7 @@ fatal (const char *format, ...)
     exit(1);
     /*NOTREACHED*/
 }
+#endif
 
 static void
 warning (const char *format, ...)
@@ -87,7 +99,8 @@ warning (const char *format, ...)
     va_list ap;
     
     va_start (ap, format);
-    fprintf (stderr, "%s: ", program_name);
+    /* program_name is only set in the benchmark */
+    fprintf (stderr, "%s: ", program_name ? program_name : "mod_xrandr");
     vfprintf (stderr, format, ap);
     va_end (ap);
 }
@@ -237,6 +250,7 @@ struct _output {
     char            *relative_to;
 
     int                    x, y;
+    double            refresh;
     Rotation            rotation;
 
     XRRPanning      panning;
@@ -271,11 +285,6 @@ struct _umode {
     name_t            name;
 };
 
-static char *connection[3] = {
-    "connected",
-    "disconnected",
-    "unknown connection"};
-
 #define OUTPUT_NAME 1
 
 #define CRTC_OFF    2
@@ -289,13 +298,156 @@ static char *connection[3] = {
 
 #define POS_UNSET   -1
 
-static output_t        *outputs = NULL;
-static output_t        **outputs_tail = &outputs;
-static crtc_t        *crtcs;
-static int        num_crtcs;
-static XRRScreenResources  *res;
-static int        minWidth, maxWidth, minHeight, maxHeight;
-static Bool            has_1_3 = False;
+/* 
+ * state of the probe being done or the snapshot being planned against, 
+ * owned by the snapshot in arena
+ */
+static __thread output_t        *outputs = NULL;
+static __thread output_t        **outputs_tail;
+static __thread crtc_t                *crtcs;
+static __thread int                num_crtcs;
+static __thread XRRScreenResources  *res;
+static __thread struct xrandr_arena *arena;
+static __thread int                minWidth, maxWidth, minHeight, maxHeight;
+static __thread int                screen_width, screen_height;
+static __thread double                screen_dpi;
+/* each thread probes over a connection of its own, and asks its version */
+static __thread Bool            has_1_3 = False;
+static __thread Bool            has_1_5 = False;
+static __thread Bool            version_known = False;
+static __thread RROutput    primary_output = None;
+
+/*
+ * All per-crtc and per-output queries of a probe are sent at once and their
+ * replies collected afterwards, so a probe waits for the server a constant
+ * number of times however many crtcs and outputs there are.
+ */
+typedef struct {
+    xcb_randr_get_crtc_info_cookie_t        info;
+} crtc_cookies_t;
+
+static __thread xcb_connection_t        *xcb;
+static __thread crtc_cookies_t        *crtc_cookies;
+static __thread xcb_randr_get_output_info_cookie_t *output_cookies;
+static __thread xcb_randr_get_output_primary_cookie_t primary_cookie;
+static __thread xcb_randr_get_screen_size_range_cookie_t size_range_cookie;
+static __thread xcb_get_geometry_cookie_t geometry_cookie;
+static __thread xcb_randr_get_monitors_cookie_t monitors_cookie;
+/* logical monitors (RandR >= 1.5), NULL if the server has none */
+static __thread xcb_randr_get_monitors_reply_t *monitors;
+
+/* 
+ * Monitor names by atom. An atom keeps its name while the server runs,
+ * so each thread asks for the name of a monitor once.
+ */
+#define NAME_CACHE_SIZE 32
+
+typedef struct {
+    Atom        atom;
+    char        name[XRANDR_NAME_MAX];
+} atom_name_t;
+
+static __thread atom_name_t        name_cache[NAME_CACHE_SIZE];
+static __thread int                name_cache_next;
+
+/* measurements of the probe being done */
+static __thread struct xrandr_probe_stats probe_stats;
+
+/* 
+ * The measurements of the last probe, on whichever thread, are the only
+ * probe state shared between threads. They are published once the probe 
+ * is done, so the lock is never held while waiting for the server.
+ */
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct xrandr_probe_stats last_probe_stats;
+
+static double
+now_ms (void)
+{
+    struct timespec        ts;
+    
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/*
+ * Everything a probe allocates comes from the arena of its snapshot, and
+ * is released with it in one go.
+ */
+#define ARENA_CHUNK_SIZE 4096
+#define ARENA_ALIGN        sizeof (double)
+#define ARENA_ROUND(n)        (((n) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+struct xrandr_arena_chunk {
+    struct xrandr_arena_chunk        *next;
+    size_t                        size;
+    size_t                        used;
+};
+
+#define ARENA_HEADER        ARENA_ROUND (sizeof (struct xrandr_arena_chunk))
+
+static void *
+arena_alloc (struct xrandr_arena *a, size_t size)
+{
+    struct xrandr_arena_chunk *chunk = a->chunks;
+    void *p;
+
+    size = ARENA_ROUND (size);
+    if (!chunk || chunk->size - chunk->used < size)
+    {
+        size_t        csize = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        
+        chunk = malloc (ARENA_HEADER + csize);
+        if (!chunk)
+            return NULL;
+        chunk->next = a->chunks;
+        chunk->size = csize;
+        chunk->used = 0;
+        a->chunks = chunk;
+    }
+    p = (char *) chunk + ARENA_HEADER + chunk->used;
+    chunk->used += size;
+    memset (p, 0, size);
+    return p;
+}
+
+static size_t
+arena_size (struct xrandr_arena *a)
+{
+    struct xrandr_arena_chunk *chunk;
+    size_t        size = 0;
+
+    for (chunk = a->chunks; chunk; chunk = chunk->next)
+        size += ARENA_HEADER + chunk->size;
+    return size;
+}
+
+static void
+arena_release (struct xrandr_arena *a)
+{
+    struct xrandr_arena_chunk *chunk = a->chunks, *next;
+
+    a->chunks = NULL;
+    for (; chunk; chunk = next)
+    {
+        next = chunk->next;
+        free (chunk);
+    }
+}
+
+static struct xrandr_snapshot *
+snapshot_new (void)
+{
+    struct xrandr_arena        a = { NULL };
+    struct xrandr_snapshot *snap;
+
+    /* the snapshot lives in its own arena */
+    snap = arena_alloc (&a, sizeof (struct xrandr_snapshot));
+    if (!snap)
+        return NULL;
+    snap->arena = a;
+    return snap;
+}
 
 static void
 init_name (name_t *name)
@@ -354,34 +506,13 @@ init_transform (transform_t *transform)
     transform->params = NULL;
 }
 
-static void
-set_transform (transform_t  *dest,
-               XTransform   *transform,
-               char            *filter,
-               XFixed            *params,
-               int            nparams)
-{
-    dest->transform = *transform;
-    dest->filter = strdup (filter);
-    dest->nparams = nparams;
-    dest->params = malloc (nparams * sizeof (XFixed));
-    memcpy (dest->params, params, nparams * sizeof (XFixed));
-}
-
-static void
-copy_transform (transform_t *dest, transform_t *src)
-{
-    set_transform (dest, &src->transform,
-                   src->filter, src->params, src->nparams);
-}
-
 static output_t *
 add_output (void)
 {
-    output_t *output = calloc (1, sizeof (output_t));
+    output_t *output = arena_alloc (arena, sizeof (output_t));
 
     if (!output)
-        fatal ("out of memory\n");
+        return NULL;
     output->next = NULL;
     output->found = False;
     output->brightness = 1.0;
@@ -482,6 +613,25 @@ find_mode_by_name (char *name)
 }
 #endif
 
+static double
+mode_refresh (XRRModeInfo *mode_info)
+{
+    double rate;
+    double vTotal = mode_info->vTotal;
+
+    if (mode_info->modeFlags & RR_DoubleScan)
+        vTotal *= 2;
+    if (mode_info->modeFlags & RR_Interlace)
+        vTotal /= 2;
+    
+    if (mode_info->hTotal && vTotal)
+        rate = ((double) mode_info->dotClock /
+                ((double) mode_info->hTotal * (double) vTotal));
+    else
+        rate = 0;
+    return rate;
+}
+
 static
 XRRModeInfo *
 find_mode_for_output (output_t *output, name_t *name)
@@ -489,6 +639,7 @@ find_mode_for_output (output_t *output, name_t *name)
     XRROutputInfo   *output_info = output->output_info;
     int                    m;
     XRRModeInfo            *best = NULL;
+    double            bestDist = 0;
 
     for (m = 0; m < output_info->nmode; m++)
     {
@@ -501,6 +652,24 @@ find_mode_for_output (output_t *output, name_t *name)
             best = mode;
             break;
         }
+        if ((name->kind & name_string) && !strcmp (name->string, mode->name))
+        {
+            double   dist;
+
+            /* Stay away from doublescan modes unless refresh rate is specified. */
+            if (!output->refresh && (mode->modeFlags & RR_DoubleScan))
+                continue;
+
+            if (output->refresh)
+                dist = fabs (mode_refresh (mode) - output->refresh);
+            else
+                dist = 0;
+            if (!best || dist < bestDist)
+            {
+                bestDist = dist;
+                best = mode;
+            }
+        }
     }
     return best;
 }
@@ -523,10 +692,10 @@ preferred_mode (output_t *output)
         if (m < output_info->npreferred)
             dist = 0;
         else if (output_info->mm_height)
-            dist = (1000 * DisplayHeight(dpy, screen) / DisplayHeightMM(dpy, screen) -
+            dist = (1000 * screen_dpi / 25.4 -
                     1000 * mode_info->height / output_info->mm_height);
         else
-            dist = DisplayHeight(dpy, screen) - mode_info->height;
+            dist = screen_height - mode_info->height;
 
         if (dist < 0) dist = -dist;
         if (!best || dist < bestDist)
@@ -586,32 +755,6 @@ crtc_can_use_transform (crtc_t *crtc, XTransform *transform)
 }
 #endif
 
-/*
- * Report only rotations that are supported by all crtcs
- */
-static Rotation
-output_rotations (output_t *output)
-{
-    Bool            found = False;
-    Rotation            rotation = RR_Rotate_0;
-    XRROutputInfo   *output_info = output->output_info;
-    int                    c;
-    
-    for (c = 0; c < output_info->ncrtc; c++)
-    {
-        crtc_t        *crtc = find_crtc_by_xid (output_info->crtcs[c]);
-        if (crtc)
-        {
-            if (!found) {
-                rotation = crtc->crtc_info->rotations;
-                found = True;
-            } else
-                rotation &= crtc->crtc_info->rotations;
-        }
-    }
-    return rotation;
-}
-
 static Bool
 output_can_use_rotation (output_t *output, Rotation rotation)
 {
@@ -636,7 +779,7 @@ static Bool
 output_is_primary(output_t *output)
 {
     if (has_1_3)
-            return XRRGetOutputPrimary(dpy, root) == output->output.xid;
+            return primary_output == output->output.xid;
     return False;
 }
 
@@ -651,28 +794,19 @@ find_last_non_clamped(CARD16 array[], int size) {
     return 0;
 }
 
-static void
-set_gamma_info(output_t *output)
+static Bool
+set_gamma_info(struct xrandr_gamma *info, XRRCrtcGamma *gamma, RRCrtc crtc)
 {
-    XRRCrtcGamma *gamma;
     double i1, v1, i2, v2;
     int size, middle, last_best, last_red, last_green, last_blue;
     CARD16 *best_array;
 
-    if (!output->crtc_info)
-        return;
-
-    size = XRRGetCrtcGammaSize(dpy, output->crtc_info->crtc.xid);
+    size = gamma->size;
     if (!size) {
-        warning("Failed to get size of gamma for output %s\n", output->output.string);
-        return;
-    }
-
-    gamma = XRRGetCrtcGamma(dpy, output->crtc_info->crtc.xid);
-    if (!gamma) {
-        warning("Failed to get gamma for output %s\n", output->output.string);
-        return;
+        warning("Failed to get size of gamma for crtc 0x%x\n", crtc);
+        return False;
     }
+    info->size = size;
 
     /*
      * Here is a bit tricky because gamma is a whole curve for each
@@ -710,27 +844,50 @@ set_gamma_info(output_t *output)
     i2 = (double)(last_best + 1) / size;
     v2 = (double)(best_array[last_best]) / 65535;
     if (v2 < 0.0001) { /* The screen is black */
-        output->brightness = 0;
-        output->gamma.red = 1;
-        output->gamma.green = 1;
-        output->gamma.blue = 1;
+        info->brightness = 0;
+        info->red = 1;
+        info->green = 1;
+        info->blue = 1;
     } else {
         if ((last_best + 1) == size)
-            output->brightness = v2;
+            info->brightness = v2;
         else
-            output->brightness = exp((log(v2)*log(i1) - log(v1)*log(i2))/log(i1/i2));
-        output->gamma.red = log((double)(gamma->red[last_red / 2]) / output->brightness
+            info->brightness = exp((log(v2)*log(i1) - log(v1)*log(i2))/log(i1/i2));
+        info->red = log((double)(gamma->red[last_red / 2]) / info->brightness
                                 / 65535) / log((double)((last_red / 2) + 1) / size);
-        output->gamma.green = log((double)(gamma->green[last_green / 2]) / output->brightness
+        info->green = log((double)(gamma->green[last_green / 2]) / info->brightness
                                   / 65535) / log((double)((last_green / 2) + 1) / size);
-        output->gamma.blue = log((double)(gamma->blue[last_blue / 2]) / output->brightness
+        info->blue = log((double)(gamma->blue[last_blue / 2]) / info->brightness
                                  / 65535) / log((double)((last_blue / 2) + 1) / size);
     }
+    return True;
+}
+
+/*
+ * Gamma is not part of a probe: only scripts ask for it, and the ramps
+ * are large. One round trip, as the ramp reply carries its size.
+ */
+Bool
+xrandr_crtc_gamma (Display *display, RRCrtc crtc, struct xrandr_gamma *info)
+{
+    XRRCrtcGamma *gamma;
+    Bool ok;
 
-    XRRFreeGamma(gamma);
+    gamma = XRRGetCrtcGamma (display, crtc);
+    if (!gamma) {
+        warning("Failed to get gamma for crtc 0x%x\n", crtc);
+        return False;
+    }
+    ok = set_gamma_info (info, gamma, crtc);
+    XRRFreeGamma (gamma);
+    return ok;
 }
 
-static void
+/*
+ * Probes never ask for changes, so the checks below only fail if the 
+ * server contradicts itself; the probe is then given up.
+ */
+static Bool
 set_output_info (output_t *output, RROutput xid, XRROutputInfo *output_info)
 {
     /* sanity check output info */
@@ -757,13 +914,17 @@ set_output_info (output_t *output, RROutput xid, XRROutputInfo *output_info)
         if (!output->crtc_info)
         {
             if (output->crtc.kind & name_xid)
-                fatal ("cannot find crtc 0x%x\n", output->crtc.xid);
-            if (output->crtc.kind & name_index)
-                fatal ("cannot find crtc %d\n", output->crtc.index);
+                warning ("cannot find crtc 0x%x\n", output->crtc.xid);
+            else if (output->crtc.kind & name_index)
+                warning ("cannot find crtc %d\n", output->crtc.index);
+            return False;
         }
         if (!output_can_use_crtc (output, output->crtc_info))
-            fatal ("output %s cannot use crtc 0x%x\n", output->output.string,
-                   output->crtc_info->crtc.xid);
+        {
+            warning ("output %s cannot use crtc 0x%x\n", output->output.string,
+                     output->crtc_info->crtc.xid);
+            return False;
+        }
     }
 
     /* set mode name and info */
@@ -777,8 +938,11 @@ set_output_info (output_t *output, RROutput xid, XRROutputInfo *output_info)
         {
             output->mode_info = find_mode_by_xid (output->mode.xid);
             if (!output->mode_info)
-                fatal ("server did not report mode 0x%x for output %s\n",
-                       output->mode.xid, output->output.string);
+            {
+                warning ("server did not report mode 0x%x for output %s\n",
+                         output->mode.xid, output->output.string);
+                return False;
+            }
         }
         else
             output->mode_info = NULL;
@@ -794,15 +958,19 @@ set_output_info (output_t *output, RROutput xid, XRROutputInfo *output_info)
         if (!output->mode_info)
         {
             if (output->mode.kind & name_preferred)
-                fatal ("cannot find preferred mode\n");
-            if (output->mode.kind & name_string)
-                fatal ("cannot find mode %s\n", output->mode.string);
-            if (output->mode.kind & name_xid)
-                fatal ("cannot find mode 0x%x\n", output->mode.xid);
+                warning ("cannot find preferred mode\n");
+            else if (output->mode.kind & name_string)
+                warning ("cannot find mode %s\n", output->mode.string);
+            else if (output->mode.kind & name_xid)
+                warning ("cannot find mode 0x%x\n", output->mode.xid);
+            return False;
         }
         if (!output_can_use_mode (output, output->mode_info))
-            fatal ("output %s cannot use mode %s\n", output->output.string,
-                   output->mode_info->name);
+        {
+            warning ("output %s cannot use mode %s\n", output->output.string,
+                     output->mode_info->name);
+            return False;
+        }
     }
 
     /* set position */
@@ -837,70 +1005,519 @@ set_output_info (output_t *output, RROutput xid, XRROutputInfo *output_info)
                                  (RR_Reflect_X|RR_Reflect_Y));
     }
     if (!output_can_use_rotation (output, output->rotation))
-        fatal ("output %s cannot use rotation \"%s\" reflection \"%s\"\n",
-               output->output.string,
-               rotation_name (output->rotation),
-               reflection_name (output->rotation));
-
-    /* set gamma */
-    if (!(output->changes & changes_gamma))
-            set_gamma_info(output);
-
-    /* set transformation */
-    if (!(output->changes & changes_transform))
     {
-        if (output->crtc_info)
-            copy_transform (&output->transform, &output->crtc_info->current_transform);
-        else
-            init_transform (&output->transform);
+        warning ("output %s cannot use rotation \"%s\" reflection \"%s\"\n",
+                 output->output.string,
+                 rotation_name (output->rotation),
+                 reflection_name (output->rotation));
+        return False;
     }
 
+    /* set transformation, not fetched by probes */
+    if (!(output->changes & changes_transform))
+        init_transform (&output->transform);
+
     /* set primary */
     if (!(output->changes & changes_primary))
         output->primary = output_is_primary(output);
+    return True;
 }
     
-static void
-get_screen (void)
+/*
+ * The screen resources are built in the arena as Xlib would lay them out.
+ * Probes go through xcb only: they may run on a thread of their own, and
+ * Xlib is not initialised for threads.
+ */
+static XRRScreenResources *
+resources_from_reply (xcb_timestamp_t timestamp, xcb_timestamp_t config_timestamp,
+                      int ncrtc, const xcb_randr_crtc_t *rep_crtcs,
+                      int noutput, const xcb_randr_output_t *rep_outputs,
+                      int nmode, const xcb_randr_mode_info_t *rep_modes,
+                      int nbytes, const uint8_t *names)
+{
+    XRRScreenResources        *r;
+    char                *name;
+    int                        i;
+
+    r = arena_alloc (arena, sizeof (XRRScreenResources) +
+                     ncrtc * sizeof (RRCrtc) +
+                     noutput * sizeof (RROutput) +
+                     nmode * sizeof (XRRModeInfo) +
+                     nbytes + nmode);
+    if (!r)
+        return NULL;
+    
+    r->timestamp = timestamp;
+    r->configTimestamp = config_timestamp;
+    r->ncrtc = ncrtc;
+    r->noutput = noutput;
+    r->nmode = nmode;
+    r->modes = (XRRModeInfo *) (r + 1);
+    r->crtcs = (RRCrtc *) (r->modes + nmode);
+    r->outputs = (RROutput *) (r->crtcs + ncrtc);
+    name = (char *) (r->outputs + noutput);
+    for (i = 0; i < ncrtc; i++)
+        r->crtcs[i] = rep_crtcs[i];
+    for (i = 0; i < noutput; i++)
+        r->outputs[i] = rep_outputs[i];
+    for (i = 0; i < nmode; i++)
+    {
+        XRRModeInfo                        *mode = &r->modes[i];
+        const xcb_randr_mode_info_t        *m = &rep_modes[i];
+        int                                len = m->name_len;
+        
+        mode->id = m->id;
+        mode->width = m->width;
+        mode->height = m->height;
+        mode->dotClock = m->dot_clock;
+        mode->hSyncStart = m->hsync_start;
+        mode->hSyncEnd = m->hsync_end;
+        mode->hTotal = m->htotal;
+        mode->hSkew = m->hskew;
+        mode->vSyncStart = m->vsync_start;
+        mode->vSyncEnd = m->vsync_end;
+        mode->vTotal = m->vtotal;
+        mode->modeFlags = m->mode_flags;
+        /* the names follow each other in the reply, unterminated */
+        if (len > nbytes)
+            len = nbytes;
+        memcpy (name, names, len);
+        name[len] = '\0';
+        mode->name = name;
+        mode->nameLength = len;
+        name += len + 1;
+        names += len;
+        nbytes -= len;
+    }
+    return r;
+}
+
+/* the reply to GetScreenResourcesCurrent, in the arena */
+static XRRScreenResources *
+resources_current (xcb_randr_get_screen_resources_current_cookie_t cookie)
+{
+    xcb_randr_get_screen_resources_current_reply_t *rep =
+        xcb_randr_get_screen_resources_current_reply (xcb, cookie, NULL);
+    XRRScreenResources        *r = NULL;
+    
+    if (rep)
+        r = resources_from_reply (
+            rep->timestamp, rep->config_timestamp,
+            xcb_randr_get_screen_resources_current_crtcs_length (rep),
+            xcb_randr_get_screen_resources_current_crtcs (rep),
+            xcb_randr_get_screen_resources_current_outputs_length (rep),
+            xcb_randr_get_screen_resources_current_outputs (rep),
+            xcb_randr_get_screen_resources_current_modes_length (rep),
+            xcb_randr_get_screen_resources_current_modes (rep),
+            xcb_randr_get_screen_resources_current_names_length (rep),
+            xcb_randr_get_screen_resources_current_names (rep));
+    free (rep);
+    return r;
+}
+
+/*
+ * GetScreenResources makes the server poll every connector for changes
+ * (reading EDID over DDC), which may take hundreds of milliseconds. Unless
+ * a reprobe was asked for, use the resources the server already knows about.
+ *
+ * The screen size, size range, primary output and monitor requests are 
+ * queued first, so they travel with the resources request.
+ */
+static Bool
+get_screen (Bool reprobe)
 {
-    XRRGetScreenSizeRange (dpy, root, &minWidth, &minHeight,
-                           &maxWidth, &maxHeight);
+    xcb_randr_get_screen_resources_cookie_t        full_cookie;
+    xcb_randr_get_screen_resources_current_cookie_t current_cookie;
+    Bool        current = has_1_3 && !reprobe;
+    
+
+    geometry_cookie = xcb_get_geometry (xcb, root);
+    size_range_cookie = xcb_randr_get_screen_size_range (xcb, root);
+    if (has_1_3)
+        primary_cookie = xcb_randr_get_output_primary (xcb, root);
+    if (has_1_5)
+    {
+        monitors_cookie = xcb_randr_get_monitors (xcb, root, 1);
+        probe_stats.requests++;
+    }
+    
+    if (current)
+        current_cookie = xcb_randr_get_screen_resources_current (xcb, root);
+    else
+        full_cookie = xcb_randr_get_screen_resources (xcb, root);
+    probe_stats.requests += has_1_3 ? 4 : 3;
+    probe_stats.round_trips++;
     
-    res = XRRGetScreenResources (dpy, root);
-    if (!res) fatal ("could not get screen resources");
+    res = NULL;
+    if (current)
+        res = resources_current (current_cookie);
+    else
+    {
+        xcb_randr_get_screen_resources_reply_t *rep =
+            xcb_randr_get_screen_resources_reply (xcb, full_cookie, NULL);
+        
+        if (rep)
+            res = resources_from_reply (
+                rep->timestamp, rep->config_timestamp,
+                xcb_randr_get_screen_resources_crtcs_length (rep),
+                xcb_randr_get_screen_resources_crtcs (rep),
+                xcb_randr_get_screen_resources_outputs_length (rep),
+                xcb_randr_get_screen_resources_outputs (rep),
+                xcb_randr_get_screen_resources_modes_length (rep),
+                xcb_randr_get_screen_resources_modes (rep),
+                xcb_randr_get_screen_resources_names_length (rep),
+                xcb_randr_get_screen_resources_names (rep));
+        free (rep);
+    }
+    if (!res)
+    {
+        warning ("could not get screen resources\n");
+        return False;
+    }
+    return True;
+}
+
+/*
+ * Replies nobody asks for stay queued in xcb until the connection is
+ * closed, so a probe that gives up throws away the rest of its batch.
+ */
+static void
+discard_screen (void)
+{
+    xcb_discard_reply (xcb, geometry_cookie.sequence);
+    xcb_discard_reply (xcb, size_range_cookie.sequence);
+    if (has_1_3)
+        xcb_discard_reply (xcb, primary_cookie.sequence);
+    if (has_1_5)
+        xcb_discard_reply (xcb, monitors_cookie.sequence);
+}
+
+static void
+discard_requests (int first_crtc, int first_output)
+{
+    int                c, o;
+
+    if (crtc_cookies)
+        for (c = first_crtc; c < res->ncrtc; c++)
+            xcb_discard_reply (xcb, crtc_cookies[c].info.sequence);
+    if (output_cookies)
+        for (o = first_output; o < res->noutput; o++)
+            xcb_discard_reply (xcb, output_cookies[o].sequence);
+    free (crtc_cookies);
+    crtc_cookies = NULL;
+    free (output_cookies);
+    output_cookies = NULL;
+}
+
+/*
+ * Queue the queries for every crtc and output of res without waiting for
+ * any replies
+ */
+static Bool
+send_requests (void)
+{
+    int                c, o;
+
+    crtc_cookies = calloc (res->ncrtc, sizeof (crtc_cookies_t));
+    output_cookies = calloc (res->noutput, 
+                             sizeof (xcb_randr_get_output_info_cookie_t));
+    if ((res->ncrtc && !crtc_cookies) || (res->noutput && !output_cookies))
+    {
+        free (crtc_cookies);
+        crtc_cookies = NULL;
+        free (output_cookies);
+        output_cookies = NULL;
+        return False;
+    }
+
+    for (c = 0; c < res->ncrtc; c++)
+    {
+        crtc_cookies[c].info = xcb_randr_get_crtc_info (xcb, res->crtcs[c],
+                                                        res->configTimestamp);
+    }
+    for (o = 0; o < res->noutput; o++)
+        output_cookies[o] = xcb_randr_get_output_info (xcb, res->outputs[o],
+                                                       res->configTimestamp);
+    probe_stats.requests += res->ncrtc + res->noutput;
+    xcb_flush (xcb);
+    return True;
 }
 
+/*
+ * These replies were sent before the screen resources, which get_screen
+ * waited for, so reading them does not wait again.
+ */
 static void
+collect_screen (void)
+{
+    xcb_randr_get_screen_size_range_reply_t        *range;
+    xcb_get_geometry_reply_t                        *geometry;
+    
+    /* 
+     * The size of the screen is asked for rather than taken from dpy, 
+     * which is not updated if it does not see the RandR events.
+     */
+    geometry = xcb_get_geometry_reply (xcb, geometry_cookie, NULL);
+    screen_width = DisplayWidth (dpy, screen);
+    screen_height = DisplayHeight (dpy, screen);
+    if (geometry) {
+        screen_width = geometry->width;
+        screen_height = geometry->height;
+        free (geometry);
+    }
+    /* every resize keeps the resolution, so the initial one is current */
+    screen_dpi = (25.4 * DisplayHeight (dpy, screen)) / 
+                 DisplayHeightMM (dpy, screen);
+    
+    range = xcb_randr_get_screen_size_range_reply (xcb, size_range_cookie, NULL);
+    if (range) {
+        minWidth = range->min_width;
+        minHeight = range->min_height;
+        maxWidth = range->max_width;
+        maxHeight = range->max_height;
+        free (range);
+    }
+    
+    primary_output = None;
+    if (has_1_3) {
+        xcb_randr_get_output_primary_reply_t *primary =
+            xcb_randr_get_output_primary_reply (xcb, primary_cookie, NULL);
+        if (primary) {
+            primary_output = primary->output;
+            free (primary);
+        }
+    }
+    
+    monitors = NULL;
+    if (has_1_5) {
+        monitors = xcb_randr_get_monitors_reply (xcb, monitors_cookie, NULL);
+        if (monitors && monitors->nMonitors == 0) {
+            free (monitors);
+            monitors = NULL;
+        }
+    }
+}
+
+/* 
+ * Build the same single-block structures Xlib would, in the arena
+ */
+static XRRCrtcInfo *
+crtc_info_from_reply (xcb_randr_get_crtc_info_reply_t *rep)
+{
+    int                        noutput, npossible, i;
+    xcb_randr_output_t        *outputs, *possible;
+    XRRCrtcInfo                *info;
+
+    /* 
+     * Like Xlib, ignore the status: a configuration change since the 
+     * resources were fetched still leaves a usable reply.
+     */
+    if (!rep)
+        return NULL;
+    
+    noutput = xcb_randr_get_crtc_info_outputs_length (rep);
+    npossible = xcb_randr_get_crtc_info_possible_length (rep);
+    outputs = xcb_randr_get_crtc_info_outputs (rep);
+    possible = xcb_randr_get_crtc_info_possible (rep);
+    
+    info = arena_alloc (arena, sizeof (XRRCrtcInfo) + 
+                        (noutput + npossible) * sizeof (RROutput));
+    if (!info)
+        return NULL;
+    
+    info->timestamp = rep->timestamp;
+    info->x = rep->x;
+    info->y = rep->y;
+    info->width = rep->width;
+    info->height = rep->height;
+    info->mode = rep->mode;
+    info->rotation = rep->rotation;
+    info->rotations = rep->rotations;
+    info->noutput = noutput;
+    info->npossible = npossible;
+    info->outputs = (RROutput *) (info + 1);
+    info->possible = info->outputs + noutput;
+    for (i = 0; i < noutput; i++)
+        info->outputs[i] = outputs[i];
+    for (i = 0; i < npossible; i++)
+        info->possible[i] = possible[i];
+    return info;
+}
+
+static XRROutputInfo *
+output_info_from_reply (xcb_randr_get_output_info_reply_t *rep)
+{
+    int                        ncrtc, nclone, nmode, namelen, i;
+    xcb_randr_crtc_t        *crtcs;
+    xcb_randr_output_t        *clones;
+    xcb_randr_mode_t        *modes;
+    XRROutputInfo        *info;
+
+    /* see crtc_info_from_reply */
+    if (!rep)
+        return NULL;
+    
+    ncrtc = xcb_randr_get_output_info_crtcs_length (rep);
+    nmode = xcb_randr_get_output_info_modes_length (rep);
+    nclone = xcb_randr_get_output_info_clones_length (rep);
+    namelen = xcb_randr_get_output_info_name_length (rep);
+    crtcs = xcb_randr_get_output_info_crtcs (rep);
+    modes = xcb_randr_get_output_info_modes (rep);
+    clones = xcb_randr_get_output_info_clones (rep);
+
+    info = arena_alloc (arena, sizeof (XRROutputInfo) +
+                        ncrtc * sizeof (RRCrtc) +
+                        nmode * sizeof (RRMode) +
+                        nclone * sizeof (RROutput) +
+                        namelen + 1);
+    if (!info)
+        return NULL;
+    
+    info->timestamp = rep->timestamp;
+    info->crtc = rep->crtc;
+    info->mm_width = rep->mm_width;
+    info->mm_height = rep->mm_height;
+    info->connection = rep->connection;
+    info->subpixel_order = rep->subpixel_order;
+    info->ncrtc = ncrtc;
+    info->nmode = nmode;
+    info->npreferred = rep->num_preferred;
+    info->nclone = nclone;
+    info->nameLen = namelen;
+    info->crtcs = (RRCrtc *) (info + 1);
+    info->modes = (RRMode *) (info->crtcs + ncrtc);
+    info->clones = (RROutput *) (info->modes + nmode);
+    info->name = (char *) (info->clones + nclone);
+    for (i = 0; i < ncrtc; i++)
+        info->crtcs[i] = crtcs[i];
+    for (i = 0; i < nmode; i++)
+        info->modes[i] = modes[i];
+    for (i = 0; i < nclone; i++)
+        info->clones[i] = clones[i];
+    memcpy (info->name, xcb_randr_get_output_info_name (rep), namelen);
+    info->name[namelen] = '\0';
+    return info;
+}
+
+/*
+ * Panning and transforms do not change the geometry of the crtc as
+ * reported in its info, so probes leave them alone. They are only fetched
+ * for crtcs somebody asks about.
+ */
+static Bool
+panning_from_reply (XRRPanning *panning, xcb_randr_get_panning_reply_t *rep)
+{
+    if (!rep || rep->status != XCB_RANDR_SET_CONFIG_SUCCESS)
+        return False;
+    /* no panning configured */
+    if (!rep->left && !rep->top && !rep->width && !rep->height &&
+        !rep->track_left && !rep->track_top && 
+        !rep->track_width && !rep->track_height &&
+        !rep->border_left && !rep->border_top &&
+        !rep->border_right && !rep->border_bottom)
+        return False;
+    
+    panning->timestamp = rep->timestamp;
+    panning->left = rep->left;
+    panning->top = rep->top;
+    panning->width = rep->width;
+    panning->height = rep->height;
+    panning->track_left = rep->track_left;
+    panning->track_top = rep->track_top;
+    panning->track_width = rep->track_width;
+    panning->track_height = rep->track_height;
+    panning->border_left = rep->border_left;
+    panning->border_top = rep->border_top;
+    panning->border_right = rep->border_right;
+    panning->border_bottom = rep->border_bottom;
+    return True;
+}
+
+static Bool
+transform_from_reply (XTransform *transform, 
+                      xcb_randr_get_crtc_transform_reply_t *rep)
+{
+    xcb_render_transform_t        *t;
+    
+    if (!rep)
+        return False;
+    
+    t = &rep->current_transform;
+    transform->matrix[0][0] = t->matrix11;
+    transform->matrix[0][1] = t->matrix12;
+    transform->matrix[0][2] = t->matrix13;
+    transform->matrix[1][0] = t->matrix21;
+    transform->matrix[1][1] = t->matrix22;
+    transform->matrix[1][2] = t->matrix23;
+    transform->matrix[2][0] = t->matrix31;
+    transform->matrix[2][1] = t->matrix32;
+    transform->matrix[2][2] = t->matrix33;
+    return True;
+}
+
+Bool
+xrandr_crtc_transform (Display *display, RRCrtc crtc, 
+                       XTransform *transform, XRRPanning *panning,
+                       Bool *has_panning)
+{
+    xcb_connection_t                        *c = XGetXCBConnection (display);
+    xcb_randr_get_crtc_transform_cookie_t transform_cookie;
+    xcb_randr_get_panning_cookie_t        panning_cookie;
+    xcb_randr_get_crtc_transform_reply_t *transform_rep;
+    xcb_randr_get_panning_reply_t        *panning_rep;
+    Bool                                ok;
+    
+    /* both replies in one round trip */
+    transform_cookie = xcb_randr_get_crtc_transform (c, crtc);
+    panning_cookie = xcb_randr_get_panning (c, crtc);
+    
+    transform_rep = xcb_randr_get_crtc_transform_reply (c, transform_cookie, NULL);
+    panning_rep = xcb_randr_get_panning_reply (c, panning_cookie, NULL);
+    
+    ok = transform_from_reply (transform, transform_rep);
+    *has_panning = panning_from_reply (panning, panning_rep);
+    
+    free (transform_rep);
+    free (panning_rep);
+    return ok;
+}
+
+static Bool
 get_crtcs (void)
 {
     int                c;
 
     num_crtcs = res->ncrtc;
-    crtcs = calloc (num_crtcs, sizeof (crtc_t));
-    if (!crtcs) fatal ("out of memory\n");
+    crtcs = arena_alloc (arena, num_crtcs * sizeof (crtc_t));
+    if (!crtcs)
+    {
+        num_crtcs = 0;
+        discard_requests (0, 0);
+        return False;
+    }
     
+    /* the first crtc reply is the second wait of the probe */
+    if (res->ncrtc > 0)
+        probe_stats.round_trips++;
     for (c = 0; c < res->ncrtc; c++)
     {
-        XRRCrtcInfo *crtc_info = XRRGetCrtcInfo (dpy, res, res->crtcs[c]);
-        XRRCrtcTransformAttributes  *attr;
-        XRRPanning  *panning_info = NULL;
-
-        if (has_1_3) {
-            XRRPanning zero;
-            memset(&zero, 0, sizeof(zero));
-            panning_info = XRRGetPanning  (dpy, res, res->crtcs[c]);
-            zero.timestamp = panning_info->timestamp;
-            if (!memcmp(panning_info, &zero, sizeof(zero))) {
-                Xfree(panning_info);
-                panning_info = NULL;
-            }
-        }
+        xcb_randr_get_crtc_info_reply_t *info_rep;
+        XRRCrtcInfo *crtc_info;
+
+        info_rep = xcb_randr_get_crtc_info_reply (xcb, crtc_cookies[c].info, NULL);
+        crtc_info = crtc_info_from_reply (info_rep);
+        free (info_rep);
 
         set_name_xid (&crtcs[c].crtc, res->crtcs[c]);
         set_name_index (&crtcs[c].crtc, c);
-        if (!crtc_info) fatal ("could not get crtc 0x%x information\n", res->crtcs[c]);
+        if (!crtc_info)
+        {
+            warning ("could not get crtc 0x%x information\n", res->crtcs[c]);
+            discard_requests (c + 1, 0);
+            return False;
+        }
         crtcs[c].crtc_info = crtc_info;
-        crtcs[c].panning_info = panning_info;
+        crtcs[c].panning_info = NULL;
         if (crtc_info->mode == None)
         {
             crtcs[c].mode_info = NULL;
@@ -908,38 +1525,42 @@ get_crtcs (void)
             crtcs[c].y = 0;
             crtcs[c].rotation = RR_Rotate_0;
         }
-        if (XRRGetCrtcTransform (dpy, res->crtcs[c], &attr) && attr) {
-            set_transform (&crtcs[c].current_transform,
-                           &attr->currentTransform,
-                           attr->currentFilter,
-                           attr->currentParams,
-                           attr->currentNparams);
-            XFree (attr);
-        }
-        else
-        {
-            init_transform (&crtcs[c].current_transform);
-        }
-        copy_transform (&crtcs[c].pending_transform, &crtcs[c].current_transform);
+        /* see xrandr_crtc_transform */
+        init_transform (&crtcs[c].current_transform);
+        init_transform (&crtcs[c].pending_transform);
    }
+   free (crtc_cookies);
+   crtc_cookies = NULL;
+   return True;
 }
 
 /*
  * Use current output state to complete the output list
  */
-static void
+static Bool
 get_outputs (void)
 {
     int                o;
     output_t    *q;
     
+    /* without crtcs, the wait is for the first output instead */
+    if (res->ncrtc == 0 && res->noutput > 0)
+        probe_stats.round_trips++;
     for (o = 0; o < res->noutput; o++)
     {
-        XRROutputInfo        *output_info = XRRGetOutputInfo (dpy, res, res->outputs[o]);
+        xcb_randr_get_output_info_reply_t *rep =
+            xcb_randr_get_output_info_reply (xcb, output_cookies[o], NULL);
+        XRROutputInfo        *output_info = output_info_from_reply (rep);
         output_t        *output;
         name_t                output_name;
+        free (rep);
         output_name.kind = 0;
-        if (!output_info) fatal ("could not get output 0x%x information\n", res->outputs[o]);
+        if (!output_info)
+        {
+            warning ("could not get output 0x%x information\n", res->outputs[o]);
+            discard_requests (0, o + 1);
+            return False;
+        }
         set_name_xid (&output_name, res->outputs[o]);
         set_name_index (&output_name, o);
         set_name_string (&output_name, output_info->name);
@@ -947,6 +1568,11 @@ get_outputs (void)
         if (!output)
         {
             output = add_output ();
+            if (!output)
+            {
+                discard_requests (0, o + 1);
+                return False;
+            }
             set_name_all (&output->output, &output_name);
             /*
              * When global --automatic mode is set, turn on connected but off
@@ -1000,8 +1626,14 @@ get_outputs (void)
             }
         }
 
-        set_output_info (output, res->outputs[o], output_info);
+        if (!set_output_info (output, res->outputs[o], output_info))
+        {
+            discard_requests (0, o + 1);
+            return False;
+        }
     }
+    free (output_cookies);
+    output_cookies = NULL;
     for (q = outputs; q; q = q->next)
     {
         if (!q->found)
@@ -1010,6 +1642,7 @@ get_outputs (void)
                     q->output.string);
         }
     }
+    return True;
 }
 
 /** connected outputs with a mode */
@@ -1025,57 +1658,298 @@ int count_relevant_outputs(output_t* outputs)
 
 #define ModeShown   0x80000000
 
-struct xrandr_output_info**
-xrandr_init(Display* display, char *display_name, int *noutputs)
+static output_t *
+find_output_by_xid (RROutput xid)
 {
-    int event_base, error_base;
-    int major, minor;
-    output_t *output;
-    struct xrandr_output_info** result;
-    int output_count = 0;
-    int output_idx = 0;
-    int i;
+    name_t        output_name;
+
+    init_name (&output_name);
+    set_name_xid (&output_name, xid);
+    return find_output (&output_name);
+}
 
-    *noutputs = -1;
+static const char *
+cached_name (Atom atom)
+{
+    int                i;
+
+    for (i = 0; i < NAME_CACHE_SIZE; i++)
+        if (atom != None && name_cache[i].atom == atom)
+            return name_cache[i].name;
+    return NULL;
+}
+
+static void
+cache_name (Atom atom, const char *name, int len)
+{
+    atom_name_t        *entry = &name_cache[name_cache_next];
+
+    name_cache_next = (name_cache_next + 1) % NAME_CACHE_SIZE;
+    if (len > XRANDR_NAME_MAX - 1)
+        len = XRANDR_NAME_MAX - 1;
+    entry->atom = atom;
+    memcpy (entry->name, name, len);
+    entry->name[len] = '\0';
+}
+
+/*
+ * Ask for the names of the monitors that are not cached; the cookies of 
+ * the others are left zero. Returns NULL if memory runs out.
+ */
+static xcb_get_atom_name_cookie_t *
+request_monitor_names (void)
+{
+    xcb_randr_monitor_info_iterator_t        iter;
+    xcb_get_atom_name_cookie_t                *cookies;
+    int                                        m;
+
+    cookies = calloc (monitors->nMonitors + 1, 
+                      sizeof (xcb_get_atom_name_cookie_t));
+    if (!cookies)
+        return NULL;
+    
+    iter = xcb_randr_get_monitors_monitors_iterator (monitors);
+    for (m = 0; m < monitors->nMonitors; m++, xcb_randr_monitor_info_next (&iter))
+    {
+        if (!cached_name (iter.data->name))
+        {
+            cookies[m] = xcb_get_atom_name (xcb, iter.data->name);
+            probe_stats.requests++;
+        }
+    }
+    return cookies;
+}
+
+/*
+ * Copy the name of mon to name, collecting the reply to cookie if it was 
+ * asked for. Only the first reply collected costs a round trip.
+ */
+static void
+monitor_name (xcb_randr_monitor_info_t *mon, xcb_get_atom_name_cookie_t cookie,
+              Bool *waited, char *name)
+{
+    const char        *cached;
+
+    if (cookie.sequence)
+    {
+        xcb_get_atom_name_reply_t *rep =
+            xcb_get_atom_name_reply (xcb, cookie, NULL);
+        
+        if (!*waited)
+            probe_stats.round_trips++;
+        *waited = True;
+        if (rep)
+        {
+            cache_name (mon->name, xcb_get_atom_name_name (rep),
+                        xcb_get_atom_name_name_length (rep));
+            free (rep);
+        }
+    }
+    cached = cached_name (mon->name);
+    strncpy (name, cached ? cached : "", XRANDR_NAME_MAX - 1);
+    name[XRANDR_NAME_MAX - 1] = '\0';
+}
+
+/*
+ * With RandR 1.5, a screen is made for each monitor rather than each 
+ * output, so that a monitor driven by several outputs (tiled panels, MST)
+ * gets one screen. The monitor takes the identity, mode and rotation of 
+ * its first output. Monitors that the server made up for an output are 
+ * named after it; the names of the others are asked for unless they were
+ * seen before. Returns -1 if memory runs out.
+ */
+static int
+monitor_results (struct xrandr_output_info **result)
+{
+    xcb_randr_monitor_info_iterator_t        iter;
+    xcb_get_atom_name_cookie_t                *name_cookies;
+    struct xrandr_output_info                *info;
+    int                                        n = monitors->nMonitors;
+    int                                        m;
+    Bool                                waited = False;
+
+    iter = xcb_randr_get_monitors_monitors_iterator (monitors);
+    for (m = 0; m < n; m++, xcb_randr_monitor_info_next (&iter))
+    {
+        xcb_randr_monitor_info_t *mon = iter.data;
+        output_t                *output = NULL;
+        
+        if (mon->automatic && xcb_randr_monitor_info_outputs_length (mon) > 0)
+            output = find_output_by_xid (xcb_randr_monitor_info_outputs (mon)[0]);
+        if (output && !cached_name (mon->name))
+            cache_name (mon->name, output->output_info->name,
+                        strlen (output->output_info->name));
+    }
+    
+    info = arena_alloc (arena, n * sizeof (struct xrandr_output_info));
+    if (!info)
+        return -1;
+    name_cookies = request_monitor_names ();
+    if (!name_cookies)
+        return -1;
+    
+    iter = xcb_randr_get_monitors_monitors_iterator (monitors);
+    for (m = 0; m < n; m++, xcb_randr_monitor_info_next (&iter))
+    {
+        xcb_randr_monitor_info_t *mon = iter.data;
+        xcb_randr_output_t        *mon_outputs = xcb_randr_monitor_info_outputs (mon);
+        int                        nmon_outputs = xcb_randr_monitor_info_outputs_length (mon);
+        output_t                *output = NULL;
+        crtc_t                        *crtc = NULL;
+        
+        if (nmon_outputs > 0)
+            output = find_output_by_xid (mon_outputs[0]);
+        if (output)
+            crtc = output->crtc_info;
+        
+        info[m].id = output ? output->output.xid : None;
+        monitor_name (mon, name_cookies[m], &waited, info[m].name);
+        info[m].x = mon->x;
+        info[m].y = mon->y;
+        info[m].w = mon->width;
+        info[m].h = mon->height;
+        info[m].mm_width = mon->width_in_millimeters;
+        info[m].mm_height = mon->height_in_millimeters;
+        info[m].primary = mon->primary;
+        info[m].rotation = output ? output->rotation : RR_Rotate_0;
+        info[m].mode = (output && output->mode_info) ? output->mode_info->id : None;
+        info[m].refresh = (output && output->mode_info) ? mode_refresh (output->mode_info) : 0;
+        /* 
+         * Crtc events describe the monitor only if it is all of one crtc; 
+         * without a crtc, they make the next relayout probe.
+         */
+        info[m].crtc = None;
+        if (nmon_outputs == 1 && crtc &&
+            crtc->crtc_info->x == mon->x && crtc->crtc_info->y == mon->y &&
+            crtc->crtc_info->width == mon->width &&
+            crtc->crtc_info->height == mon->height)
+            info[m].crtc = crtc->crtc.xid;
+    }
+    
+    free (name_cookies);
+    free (monitors);
+    monitors = NULL;
+    *result = info;
+    return n;
+}
+
+/*
+ * Set up the state of this thread for probing display, asking for the
+ * RandR version the first time
+ */
+static Bool
+x_connect (Display *display)
+{
+    int major, minor;
 
     dpy = display;
 
     if (dpy == NULL) {
-        fprintf (stderr, "Can't open display %s\n", XDisplayName(display_name));
-        return NULL;
+        fprintf (stderr, "No display\n");
+        return False;
     }
     if (screen < 0)
         screen = DefaultScreen (dpy);
     if (screen >= ScreenCount (dpy)) {
         fprintf (stderr, "Invalid screen number %d (display has %d)\n",
                  screen, ScreenCount (dpy));
-        return NULL;
+        return False;
     }
 
     root = RootWindow (dpy, screen);
+    xcb = XGetXCBConnection (dpy);
 
-    if (!XRRQueryExtension (dpy, &event_base, &error_base) ||
-        !XRRQueryVersion (dpy, &major, &minor))
+    /* the version does not change for the lifetime of the connection */
+    if (!version_known)
     {
-        fprintf (stderr, "RandR extension missing\n");
+        const xcb_query_extension_reply_t        *ext;
+        xcb_randr_query_version_reply_t                *version = NULL;
+        
+        ext = xcb_get_extension_data (xcb, &xcb_randr_id);
+        if (ext && ext->present)
+            version = xcb_randr_query_version_reply (
+                xcb, xcb_randr_query_version (xcb, 1, 5), NULL);
+        if (!version)
+        {
+            fprintf (stderr, "RandR extension missing\n");
+            return False;
+        }
+        major = version->major_version;
+        minor = version->minor_version;
+        free (version);
+        probe_stats.requests++;
+        probe_stats.round_trips++;
+        if (major < 1 || (major == 1 && minor < 2))
+        {
+            fprintf (stderr, "At least XRandR 1.2 is required\n");
+            return False;
+        }
+        if (major > 1 || (major == 1 && minor >= 3))
+            has_1_3 = True;
+        if (major > 1 || (major == 1 && minor >= 5))
+            has_1_5 = True;
+        version_known = True;
+    }
+    return True;
+}
+
+static struct xrandr_snapshot *
+x_probe (Display* display, Bool reprobe)
+{
+    output_t *output;
+    struct xrandr_snapshot *snap;
+    struct xrandr_output_info *result;
+    struct xrandr_arena a;
+    int output_count = 0;
+    int output_idx = 0;
+    double t0, t1, t2, t3;
+
+    if (!x_connect (display))
         return NULL;
+    /* without XRRGetScreenResourcesCurrent every query is a full probe */
+    if (!has_1_3)
+        reprobe = True;
+    
+    snap = snapshot_new ();
+    if (!snap)
+        return NULL;
+    snap->reprobed = reprobe;
+    arena = &snap->arena;
+    outputs = NULL;
+    outputs_tail = &outputs;
+    crtcs = NULL;
+    num_crtcs = 0;
+    
+    t0 = now_ms ();
+    if (!get_screen (reprobe) || !send_requests ())
+    {
+        discard_screen ();
+        goto fail;
     }
-    if (major < 1 || (major == 1 && minor < 2))
+    collect_screen ();
+    t1 = now_ms ();
+    if (!get_crtcs ())
+        goto fail;
+    t2 = now_ms ();
+    if (!get_outputs ())
+        goto fail;
+    t3 = now_ms ();
+    probe_stats.screen_ms = t1 - t0;
+    probe_stats.crtcs_ms = t2 - t1;
+    probe_stats.outputs_ms = t3 - t2;
+
+    if (monitors)
     {
-        fprintf (stderr, "At least XRandR 1.2 is required\n");
-        return NULL;
+        output_count = monitor_results (&result);
+        if (output_count < 0)
+            goto fail;
+        goto done;
     }
-    if (major > 1 || (major == 1 && minor >= 3))
-        has_1_3 = True;
     
-    get_screen ();
-    get_crtcs ();
-    get_outputs ();
-
-    fprintf (stderr, "Screen %d\n", screen);
-
     output_count = count_relevant_outputs(outputs);
-    result = (struct xrandr_output_info**) malloc(output_count * sizeof(struct xrandr_output_info*));
+    result = arena_alloc (arena, output_count * sizeof (struct xrandr_output_info));
+    if (!result)
+        goto fail;
 
     for (output = outputs; output; output = output->next)
     {
@@ -1083,72 +1957,1110 @@ xrandr_init(Display* display, char *display_name, int *noutputs)
         crtc_t            *crtc = output->crtc_info;
         XRRCrtcInfo            *crtc_info = crtc ? crtc->crtc_info : NULL;
         XRRModeInfo            *mode = output->mode_info;
-        Rotation            rotations = output_rotations (output);
 
-        fprintf (stderr, "%s %s", output_info->name, connection[output_info->connection]);
-        if (mode && output_info->connection == RR_Connected)
+        if (!mode || output_info->connection != RR_Connected)
+            continue;
+        
+        result[output_idx].id = output->output.xid;
+        strncpy (result[output_idx].name, output_info->name, XRANDR_NAME_MAX - 1);
+        result[output_idx].name[XRANDR_NAME_MAX - 1] = '\0';
+        result[output_idx].rotation = output->rotation;
+        result[output_idx].crtc = crtc ? crtc->crtc.xid : None;
+        result[output_idx].mode = mode->id;
+        result[output_idx].refresh = mode_refresh (mode);
+        result[output_idx].mm_width = output_info->mm_width;
+        result[output_idx].mm_height = output_info->mm_height;
+        result[output_idx].primary = output->primary;
+        if (crtc_info) {
+            result[output_idx].x = crtc_info->x;
+            result[output_idx].y = crtc_info->y;
+            result[output_idx].w = crtc_info->width;
+            result[output_idx].h = crtc_info->height;
+        } else {
+            result[output_idx].x = output->x;
+            result[output_idx].y = output->y;
+            result[output_idx].w = mode->width;
+            result[output_idx].h = mode->height;
+        }
+        output_idx++;
+    }
+    
+done:
+    snap->noutputs = output_count;
+    snap->outputs = result;
+    snap->res = res;
+    snap->width = screen_width;
+    snap->height = screen_height;
+    snap->dpi = screen_dpi;
+    snap->min_width = minWidth;
+    snap->min_height = minHeight;
+    snap->max_width = maxWidth;
+    snap->max_height = maxHeight;
+    snap->has_1_3 = has_1_3;
+    snap->has_monitors = has_1_5;
+    snap->modes = res->modes;
+    snap->nmode = res->nmode;
+    snap->crtcs = crtcs;
+    snap->ncrtc = num_crtcs;
+    snap->output_list = outputs;
+    snap->timestamp = res->timestamp;
+    snap->config_timestamp = res->configTimestamp;
+    probe_stats.bytes = arena_size (arena);
+    arena = NULL;
+    return snap;
+
+fail:
+    /* nothing of a probe that was given up is kept */
+    free (monitors);
+    monitors = NULL;
+    res = NULL;
+    crtcs = NULL;
+    num_crtcs = 0;
+    outputs = NULL;
+    outputs_tail = &outputs;
+    arena = NULL;
+    a = snap->arena;
+    arena_release (&a);
+    return NULL;
+}
+
+/*
+ * Probe the monitor list alone, for relayouts that need no more. The 
+ * monitors and the modes the server knows are asked for together, so 
+ * this waits once, and once more only for monitor names not seen before.
+ * The crtcs and outputs are not looked at, nor is the hardware reprobed.
+ */
+static struct xrandr_snapshot *
+x_probe_monitors (Display *display, Bool reprobe)
+{
+    xcb_randr_get_screen_resources_current_cookie_t current_cookie;
+    xcb_randr_monitor_info_iterator_t        iter;
+    xcb_get_atom_name_cookie_t                *name_cookies = NULL;
+    struct xrandr_output_info                *info = NULL;
+    struct xrandr_snapshot                *snap;
+    struct xrandr_arena                        a;
+    Bool                                waited = False;
+    int                                        n = 0, m;
+    double                                t0;
+
+    if (!x_connect (display) || !has_1_5)
+        return NULL;
+    
+    snap = snapshot_new ();
+    if (!snap)
+        return NULL;
+    arena = &snap->arena;
+    
+    t0 = now_ms ();
+    monitors_cookie = xcb_randr_get_monitors (xcb, root, 1);
+    current_cookie = xcb_randr_get_screen_resources_current (xcb, root);
+    probe_stats.requests += 2;
+    probe_stats.round_trips++;
+    res = resources_current (current_cookie);
+    monitors = xcb_randr_get_monitors_reply (xcb, monitors_cookie, NULL);
+    if (monitors)
+        n = monitors->nMonitors;
+    
+    /* without monitors, the outputs have to be walked after all */
+    if (res && n > 0)
+    {
+        info = arena_alloc (arena, n * sizeof (struct xrandr_output_info));
+        snap->one_crtc = arena_alloc (arena, n * sizeof (Bool));
+    }
+    if (info && snap->one_crtc)
+        name_cookies = request_monitor_names ();
+    if (!name_cookies)
+        goto fail;
+    
+    iter = xcb_randr_get_monitors_monitors_iterator (monitors);
+    for (m = 0; m < n; m++, xcb_randr_monitor_info_next (&iter))
+    {
+        xcb_randr_monitor_info_t *mon = iter.data;
+        int                        nmon_outputs = xcb_randr_monitor_info_outputs_length (mon);
+        
+        info[m].id = (nmon_outputs > 0 
+                      ? xcb_randr_monitor_info_outputs (mon)[0] : None);
+        monitor_name (mon, name_cookies[m], &waited, info[m].name);
+        info[m].x = mon->x;
+        info[m].y = mon->y;
+        info[m].w = mon->width;
+        info[m].h = mon->height;
+        info[m].mm_width = mon->width_in_millimeters;
+        info[m].mm_height = mon->height_in_millimeters;
+        info[m].primary = mon->primary;
+        info[m].rotation = RR_Rotate_0;
+        /* the server makes a monitor of each crtc in use */
+        snap->one_crtc[m] = (mon->automatic && nmon_outputs == 1);
+    }
+    probe_stats.screen_ms = now_ms () - t0;
+    
+    snap->monitors_only = True;
+    snap->has_monitors = True;
+    snap->noutputs = n;
+    snap->outputs = info;
+    snap->modes = res->modes;
+    snap->nmode = res->nmode;
+    snap->timestamp = res->timestamp;
+    snap->config_timestamp = res->configTimestamp;
+    probe_stats.bytes = arena_size (arena);
+    free (name_cookies);
+    free (monitors);
+    monitors = NULL;
+    res = NULL;
+    arena = NULL;
+    return snap;
+
+fail:
+    free (monitors);
+    monitors = NULL;
+    res = NULL;
+    arena = NULL;
+    a = snap->arena;
+    arena_release (&a);
+    return NULL;
+}
+
+/*
+ * Applying a layout. The whole layout is checked and turned into a list
+ * of crtc settings first; nothing is sent unless all of it can be done.
+ */
+
+typedef struct {
+    RRCrtc        crtc;
+    RRMode        mode;
+    int                x, y;
+    Rotation        rotation;
+    int                noutput;
+    RROutput        *outputs;
+} crtc_setting_t;
+
+struct xrandr_plan {
+    Time        config_timestamp;
+    /* framebuffer size, set only if it changes */
+    Bool        resize;
+    int                fb_width, fb_height;
+    int                fb_width_mm, fb_height_mm;
+    /* crtcs turned off before the framebuffer is resized */
+    int                ndisable;
+    crtc_setting_t *disable;
+    /* crtcs set afterwards */
+    int                nenable;
+    crtc_setting_t *enable;
+    RROutput        primary;
+    /* everything above, the plan included */
+    struct xrandr_arena arena;
+};
+
+static void
+set_error (char *error, int errlen, const char *format, ...)
+{
+    va_list ap;
+
+    if (!error || errlen <= 0)
+        return;
+    va_start (ap, format);
+    vsnprintf (error, errlen, format, ap);
+    va_end (ap);
+}
+
+static Bool
+use_probe_state (struct xrandr_snapshot *snap)
+{
+    if (!snap->res)
+        return False;
+    res = snap->res;
+    crtcs = snap->crtcs;
+    num_crtcs = snap->ncrtc;
+    outputs = snap->output_list;
+    arena = &snap->arena;
+    screen_width = snap->width;
+    screen_height = snap->height;
+    screen_dpi = snap->dpi;
+    return True;
+}
+
+/* Start planning from the configuration the server reported */
+static void
+reset_pending (void)
+{
+    output_t        *output;
+    int                c;
+
+    for (c = 0; c < num_crtcs; c++)
+    {
+        crtcs[c].changing = False;
+        crtcs[c].mode_info = NULL;
+        crtcs[c].outputs = NULL;
+        crtcs[c].noutput = 0;
+    }
+    for (output = outputs; output; output = output->next)
+    {
+        XRROutputInfo        *output_info = output->output_info;
+        crtc_t                *crtc = NULL;
+
+        if (output_info->crtc)
+            crtc = find_crtc_by_xid (output_info->crtc);
+        
+        output->changes = changes_none;
+        output->current_crtc_info = crtc;
+        output->crtc_info = NULL;
+        output->refresh = 0;
+        output->primary = False;
+        if (crtc && crtc->crtc_info->mode != None)
         {
-            result[output_idx] = (struct xrandr_output_info*) malloc(sizeof(struct xrandr_output_info));
-            if (crtc_info) {
-                result[output_idx]->x = crtc_info->x;
-                result[output_idx]->y = crtc_info->y;
-                result[output_idx]->w = crtc_info->width;
-                result[output_idx]->h = crtc_info->height;
-                fprintf (stderr, " %dx%d+%d+%d",
-                        crtc_info->width, crtc_info->height,
-                        crtc_info->x, crtc_info->y);
-            } else {
-                result[output_idx]->x = output->x;
-                result[output_idx]->y = output->y;
-                result[output_idx]->w = mode->width;
-                result[output_idx]->h = mode->height;
-                fprintf (stderr, " %dx%d+%d+%d",
-                        mode->width, mode->height, output->x, output->y);
-            }
-            if (output->rotation != RR_Rotate_0)
-            {
-                fprintf (stderr, " %s", 
-                        rotation_name (output->rotation));
-                if (output->rotation & (RR_Reflect_X|RR_Reflect_Y))
-                    fprintf (stderr, " %s", reflection_name (output->rotation));
-            }
-            output_idx++;
+            output->mode_info = find_mode_by_xid (crtc->crtc_info->mode);
+            output->x = crtc->crtc_info->x;
+            output->y = crtc->crtc_info->y;
+            output->rotation = crtc->crtc_info->rotation;
         }
-        if (rotations != RR_Rotate_0)
+        else
         {
-            Bool    first = True;
-            printf (" (");
-            for (i = 0; i < 4; i ++) {
-                if ((rotations >> i) & 1) {
-                    if (!first) printf (" "); first = False;
-                    printf("%s", direction[i]);
-                    first = False;
-                }
-            }
-            if (rotations & RR_Reflect_X)
-            {
-                if (!first) printf (" "); first = False;
-                printf ("x axis");
-            }
-            if (rotations & RR_Reflect_Y)
+            output->mode_info = NULL;
+            output->x = 0;
+            output->y = 0;
+            output->rotation = RR_Rotate_0;
+        }
+    }
+}
+
+static output_t *
+find_output_by_name (const char *name)
+{
+    name_t        output_name;
+
+    init_name (&output_name);
+    set_name_string (&output_name, (char *) name);
+    return find_output (&output_name);
+}
+
+/*
+ * Check that output can be turned on as config says, and set its mode
+ */
+static Bool
+check_output_config (output_t *output, 
+                     const struct xrandr_output_config *config,
+                     char *error, int errlen)
+{
+    XRROutputInfo   *output_info = output->output_info;
+    int                    c;
+
+    if (output_info->connection != RR_Connected)
+    {
+        set_error (error, errlen, "output %s is not connected", config->name);
+        return False;
+    }
+    
+    output->refresh = config->refresh;
+    if (config->mode[0] == '\0')
+        output->mode_info = preferred_mode (output);
+    else
+    {
+        name_t        mode_name;
+        
+        init_name (&mode_name);
+        set_name_string (&mode_name, (char *) config->mode);
+        output->mode_info = find_mode_for_output (output, &mode_name);
+    }
+    if (!output->mode_info || !output_can_use_mode (output, output->mode_info))
+    {
+        set_error (error, errlen, "output %s cannot use mode %s", 
+                   config->name, config->mode[0] ? config->mode : "preferred");
+        return False;
+    }
+    
+    if (!output_can_use_rotation (output, config->rotation))
+    {
+        set_error (error, errlen, "output %s cannot use rotation \"%s\"",
+                   config->name, rotation_name (config->rotation));
+        return False;
+    }
+    
+    for (c = 0; c < output_info->ncrtc; c++)
+    {
+        crtc_t        *crtc = find_crtc_by_xid (output_info->crtcs[c]);
+        
+        if (crtc && output_can_use_crtc (output, crtc))
+            return True;
+    }
+    set_error (error, errlen, "output %s has no crtc", config->name);
+    return False;
+}
+
+static Bool
+plan_output (const struct xrandr_output_config *config, char *error, int errlen)
+{
+    output_t        *output = find_output_by_name (config->name);
+
+    if (!output)
+    {
+        set_error (error, errlen, "no output %s", config->name);
+        return False;
+    }
+    
+    if (!config->enabled)
+    {
+        output->mode_info = NULL;
+        output->changes |= changes_crtc | changes_mode;
+        return True;
+    }
+    
+    if (!check_output_config (output, config, error, errlen))
+        return False;
+    
+    output->x = config->x;
+    output->y = config->y;
+    output->rotation = config->rotation;
+    output->changes |= changes_mode | changes_position | changes_rotation;
+    if (config->primary)
+    {
+        output->primary = True;
+        output->changes |= changes_primary;
+    }
+    return True;
+}
+
+/* outputs sharing a crtc must show the same picture */
+static Bool
+crtc_fits (crtc_t *crtc, output_t *output)
+{
+    if (!output_can_use_crtc (output, crtc) ||
+        !crtc_can_use_rotation (crtc, output->rotation))
+        return False;
+    if (crtc->noutput == 0)
+        return True;
+    return (crtc->mode_info == output->mode_info &&
+            crtc->x == output->x && crtc->y == output->y &&
+            crtc->rotation == output->rotation);
+}
+
+static void
+assign_crtc (crtc_t *crtc, output_t *output)
+{
+    if (crtc->noutput == 0)
+    {
+        crtc->mode_info = output->mode_info;
+        crtc->x = output->x;
+        crtc->y = output->y;
+        crtc->rotation = output->rotation;
+    }
+    crtc->noutput++;
+    output->crtc_info = crtc;
+}
+
+/*
+ * Outputs stay on their crtc if they can; the others get a free one
+ */
+static Bool
+pick_crtcs (char *error, int errlen)
+{
+    output_t        *output;
+    int                c;
+
+    for (output = outputs; output; output = output->next)
+    {
+        crtc_t        *crtc = output->current_crtc_info;
+        
+        if (output->mode_info && crtc && crtc_fits (crtc, output))
+            assign_crtc (crtc, output);
+    }
+    
+    for (output = outputs; output; output = output->next)
+    {
+        XRROutputInfo        *output_info = output->output_info;
+        
+        if (!output->mode_info || output->crtc_info)
+            continue;
+        for (c = 0; c < output_info->ncrtc; c++)
+        {
+            crtc_t        *crtc = find_crtc_by_xid (output_info->crtcs[c]);
+            
+            if (crtc && crtc->noutput == 0 && crtc_fits (crtc, output))
             {
-                if (!first) printf (" "); first = False;
-                printf ("y axis");
+                assign_crtc (crtc, output);
+                break;
             }
-            printf (")");
         }
+        if (!output->crtc_info)
+        {
+            set_error (error, errlen, "no free crtc for output %s",
+                       output->output.string);
+            return False;
+        }
+    }
+    
+    for (c = 0; c < num_crtcs; c++)
+    {
+        crtcs[c].outputs = arena_alloc (arena, crtcs[c].noutput * 
+                                        sizeof (output_t *));
+        if (!crtcs[c].outputs)
+        {
+            set_error (error, errlen, "out of memory");
+            return False;
+        }
+        crtcs[c].noutput = 0;
+    }
+    for (output = outputs; output; output = output->next)
+    {
+        crtc_t        *crtc = output->crtc_info;
+        
+        if (crtc)
+            crtc->outputs[crtc->noutput++] = output;
+    }
+    return True;
+}
 
-        fprintf (stderr, "\n");
+static Bool
+crtc_outputs_changed (crtc_t *crtc)
+{
+    XRRCrtcInfo        *crtc_info = crtc->crtc_info;
+    int                o;
+
+    if (crtc->noutput != crtc_info->noutput)
+        return True;
+    for (o = 0; o < crtc->noutput; o++)
+    {
+        int        i;
+        
+        for (i = 0; i < crtc_info->noutput; i++)
+            if (crtc_info->outputs[i] == crtc->outputs[o]->output.xid)
+                break;
+        if (i == crtc_info->noutput)
+            return True;
+    }
+    return False;
+}
+
+static Bool
+crtc_changed (crtc_t *crtc)
+{
+    XRRCrtcInfo        *crtc_info = crtc->crtc_info;
+    RRMode        mode = crtc->mode_info ? crtc->mode_info->id : None;
+
+    if (mode != crtc_info->mode)
+        return True;
+    if (mode == None)
+        return False;
+    return (crtc->x != crtc_info->x || crtc->y != crtc_info->y ||
+            crtc->rotation != crtc_info->rotation ||
+            crtc_outputs_changed (crtc));
+}
+
+static void
+crtc_size (crtc_t *crtc, int *w, int *h)
+{
+    if (crtc->rotation & (RR_Rotate_90 | RR_Rotate_270))
+    {
+        *w = crtc->mode_info->height;
+        *h = crtc->mode_info->width;
+    }
+    else
+    {
+        *w = crtc->mode_info->width;
+        *h = crtc->mode_info->height;
     }
-    *noutputs = output_count;
-    return result;
+}
+
+static Bool
+crtc_setting (crtc_setting_t *setting, crtc_t *crtc)
+{
+    int                o;
+
+    setting->crtc = crtc->crtc.xid;
+    setting->mode = crtc->mode_info ? crtc->mode_info->id : None;
+    setting->x = crtc->x;
+    setting->y = crtc->y;
+    setting->rotation = crtc->mode_info ? crtc->rotation : RR_Rotate_0;
+    setting->noutput = crtc->noutput;
+    setting->outputs = arena_alloc (arena, crtc->noutput * sizeof (RROutput));
+    if (!setting->outputs)
+        return False;
+    for (o = 0; o < crtc->noutput; o++)
+        setting->outputs[o] = crtc->outputs[o]->output.xid;
+    return True;
+}
+
+struct xrandr_plan *
+xrandr_plan_layout (struct xrandr_snapshot *snap,
+                    const struct xrandr_output_config *configs, int nconfigs,
+                    char *error, int errlen)
+{
+    struct xrandr_plan        *plan;
+    struct xrandr_arena        pa = { NULL };
+    output_t                *output;
+    int                        fb_width = 0, fb_height = 0;
+    int                        c, i;
+
+    if (!use_probe_state (snap))
+    {
+        set_error (error, errlen, "no screen resources to check against");
+        return NULL;
+    }
+    /* plans have an arena of their own, so planning does not grow snap */
+    arena = &pa;
+    
+    reset_pending ();
+    for (i = 0; i < nconfigs; i++)
+        if (!plan_output (&configs[i], error, errlen))
+            goto fail;
+    if (!pick_crtcs (error, errlen))
+        goto fail;
+    
+    /* the framebuffer is resized once, to hold all crtcs */
+    for (c = 0; c < num_crtcs; c++)
+    {
+        crtc_t        *crtc = &crtcs[c];
+        int        w, h;
+        
+        crtc->changing = crtc_changed (crtc);
+        if (!crtc->mode_info)
+            continue;
+        crtc_size (crtc, &w, &h);
+        if (crtc->x + w > fb_width)
+            fb_width = crtc->x + w;
+        if (crtc->y + h > fb_height)
+            fb_height = crtc->y + h;
+    }
+    if (fb_width == 0 || fb_height == 0)
+    {
+        set_error (error, errlen, "the layout turns off all outputs");
+        goto fail;
+    }
+    /* the snapshot may come from another thread, with limits of its own */
+    if (fb_width < snap->min_width) fb_width = snap->min_width;
+    if (fb_height < snap->min_height) fb_height = snap->min_height;
+    if (fb_width > snap->max_width || fb_height > snap->max_height)
+    {
+        set_error (error, errlen, "screen size %dx%d exceeds %dx%d",
+                   fb_width, fb_height, snap->max_width, snap->max_height);
+        goto fail;
+    }
+    
+    plan = arena_alloc (arena, sizeof (struct xrandr_plan));
+    if (!plan)
+        goto oom;
+    plan->config_timestamp = res->configTimestamp;
+    plan->fb_width = fb_width;
+    plan->fb_height = fb_height;
+    plan->resize = (fb_width != snap->width || fb_height != snap->height);
+    if (plan->resize)
+    {
+        /* keep the resolution */
+        plan->fb_width_mm = (25.4 * fb_width) / snap->dpi;
+        plan->fb_height_mm = (25.4 * fb_height) / snap->dpi;
+    }
+    
+    plan->disable = arena_alloc (arena, num_crtcs * sizeof (crtc_setting_t));
+    plan->enable = arena_alloc (arena, num_crtcs * sizeof (crtc_setting_t));
+    if (!plan->disable || !plan->enable)
+        goto oom;
+    for (c = 0; c < num_crtcs; c++)
+    {
+        crtc_t                *crtc = &crtcs[c];
+        XRRCrtcInfo        *crtc_info = crtc->crtc_info;
+        
+        if (!crtc->changing)
+            continue;
+        /* 
+         * A crtc that is on is turned off first if it goes off, loses or
+         * gets outputs, or would not fit the new framebuffer.
+         */
+        if (crtc_info->mode != None &&
+            (!crtc->mode_info || crtc_outputs_changed (crtc) ||
+             crtc_info->x + (int) crtc_info->width > fb_width ||
+             crtc_info->y + (int) crtc_info->height > fb_height))
+        {
+            crtc_setting_t        *setting = &plan->disable[plan->ndisable++];
+            
+            setting->crtc = crtc->crtc.xid;
+            setting->mode = None;
+            setting->rotation = RR_Rotate_0;
+        }
+        if (crtc->mode_info &&
+            !crtc_setting (&plan->enable[plan->nenable++], crtc))
+            goto oom;
+    }
+    
+    /* the primary output can only be set from RandR 1.3 on */
+    plan->primary = None;
+    for (output = outputs; output && snap->has_1_3; output = output->next)
+        if (output->primary)
+            plan->primary = output->output.xid;
+    /* Leave the primary output alone if it already is */
+    for (i = 0; i < snap->noutputs; i++)
+        if (snap->outputs[i].id == plan->primary && snap->outputs[i].primary)
+            plan->primary = None;
+    
+    arena = NULL;
+    plan->arena = pa;
+    return plan;
+
+oom:
+    set_error (error, errlen, "out of memory");
+fail:
+    arena = NULL;
+    arena_release (&pa);
+    return NULL;
+}
+
+Bool
+xrandr_check_layout (struct xrandr_snapshot *snap,
+                     const struct xrandr_output_config *configs, int nconfigs,
+                     char *error, int errlen)
+{
+    Bool        ok = True;
+    int                i;
+
+    if (!use_probe_state (snap))
+    {
+        set_error (error, errlen, "no screen resources to check against");
+        return False;
+    }
+    
+    reset_pending ();
+    for (i = 0; i < nconfigs && ok; i++)
+    {
+        output_t        *output = find_output_by_name (configs[i].name);
+        
+        if (output && configs[i].enabled &&
+            output->output_info->connection == RR_Connected)
+            ok = check_output_config (output, &configs[i], error, errlen);
+    }
+    arena = NULL;
+    return ok;
+}
+
+Bool
+xrandr_layout_matches (struct xrandr_snapshot *snap,
+                       const struct xrandr_output_config *configs, int nconfigs)
+{
+    output_t        *output;
+    int                nconnected = 0;
+    int                i;
+
+    if (!use_probe_state (snap))
+        return False;
+    
+    arena = NULL;
+    for (output = outputs; output; output = output->next)
+        if (output->output_info->connection == RR_Connected)
+            nconnected++;
+    if (nconnected != nconfigs)
+        return False;
+    
+    for (i = 0; i < nconfigs; i++)
+    {
+        output = find_output_by_name (configs[i].name);
+        if (!output || output->output_info->connection != RR_Connected)
+            return False;
+    }
+    return True;
+}
+
+void
+xrandr_plan_free (struct xrandr_plan *plan)
+{
+    struct xrandr_arena a;
+    
+    if (!plan)
+        return;
+    a = plan->arena;
+    arena_release (&a);
+}
+
+Bool
+xrandr_plan_is_empty (const struct xrandr_plan *plan)
+{
+    return !plan->resize && plan->ndisable == 0 && plan->nenable == 0 &&
+           plan->primary == None;
+}
+
+static void
+send_crtc_setting (xcb_connection_t *c, const struct xrandr_plan *plan,
+                   const crtc_setting_t *setting,
+                   xcb_randr_set_crtc_config_cookie_t *cookie)
+{
+    *cookie = xcb_randr_set_crtc_config (c, setting->crtc, CurrentTime,
+                                         plan->config_timestamp,
+                                         setting->x, setting->y, setting->mode,
+                                         setting->rotation, setting->noutput,
+                                         (xcb_randr_output_t *) setting->outputs);
+}
+
+Bool
+xrandr_plan_apply (Display *display, const struct xrandr_plan *plan,
+                   char *error, int errlen)
+{
+    xcb_connection_t        *c = XGetXCBConnection (display);
+    Window                root_win = RootWindow (display, DefaultScreen (display));
+    xcb_randr_set_crtc_config_cookie_t *cookies;
+    int                        n = plan->ndisable + plan->nenable;
+    Bool                ok = True;
+    int                        i;
+
+    cookies = calloc (n + 1, sizeof (xcb_randr_set_crtc_config_cookie_t));
+    if (!cookies)
+    {
+        set_error (error, errlen, "out of memory");
+        return False;
+    }
+    
+    /* 
+     * Everything is sent at once with the server grabbed, so clients 
+     * only see the final layout, and the replies are collected in a 
+     * single round trip afterwards.
+     */
+    xcb_grab_server (c);
+    for (i = 0; i < plan->ndisable; i++)
+        send_crtc_setting (c, plan, &plan->disable[i], &cookies[i]);
+    if (plan->resize)
+        xcb_randr_set_screen_size (c, root_win, plan->fb_width, plan->fb_height,
+                                   plan->fb_width_mm, plan->fb_height_mm);
+    for (i = 0; i < plan->nenable; i++)
+        send_crtc_setting (c, plan, &plan->enable[i], 
+                           &cookies[plan->ndisable + i]);
+    if (plan->primary != None)
+        xcb_randr_set_output_primary (c, root_win, plan->primary);
+    xcb_ungrab_server (c);
+    xcb_flush (c);
+    
+    for (i = 0; i < n; i++)
+    {
+        xcb_randr_set_crtc_config_reply_t *rep =
+            xcb_randr_set_crtc_config_reply (c, cookies[i], NULL);
+        
+        if (ok && (!rep || rep->status != XCB_RANDR_SET_CONFIG_SUCCESS))
+        {
+            const crtc_setting_t *setting = (i < plan->ndisable
+                                             ? &plan->disable[i]
+                                             : &plan->enable[i - plan->ndisable]);
+            
+            set_error (error, errlen, "configuring crtc 0x%x failed",
+                       (unsigned int) setting->crtc);
+            ok = False;
+        }
+        free (rep);
+    }
+    free (cookies);
+    return ok;
+}
+
+static const struct xrandr_backend x_backend = { "x", x_probe, True };
+
+static const struct xrandr_backend *backend = &x_backend;
+
+void
+xrandr_set_backend (const struct xrandr_backend *b)
+{
+    backend = b ? b : &x_backend;
+}
+
+const struct xrandr_backend *
+xrandr_get_backend (void)
+{
+    return backend;
+}
+
+static struct xrandr_snapshot *
+probe_with (struct xrandr_snapshot *(*probe) (Display *, Bool), 
+            Display *display, Bool reprobe)
+{
+    struct xrandr_snapshot *snap;
+    
+    memset (&probe_stats, 0, sizeof (probe_stats));
+    snap = probe (display, reprobe);
+    if (snap)
+        snap->round_trips = probe_stats.round_trips;
+    
+    pthread_mutex_lock (&state_lock);
+    last_probe_stats = probe_stats;
+    pthread_mutex_unlock (&state_lock);
+    return snap;
+}
+
+struct xrandr_snapshot *
+xrandr_probe (Display *display, Bool reprobe)
+{
+    return probe_with (backend->probe, display, reprobe);
+}
+
+struct xrandr_snapshot *
+xrandr_probe_server (Display *display, Bool reprobe)
+{
+    return probe_with (x_probe, display, reprobe);
+}
+
+struct xrandr_snapshot *
+xrandr_probe_monitors (Display *display)
+{
+    return probe_with (x_probe_monitors, display, False);
+}
+
+Bool
+xrandr_complete_snapshot (struct xrandr_snapshot *snap,
+                          const struct xrandr_output_state *states, 
+                          int nstates)
+{
+    int                i, j, m;
+    
+    if (!snap->monitors_only)
+        return True;
+    
+    for (i = 0; i < snap->noutputs; i++)
+    {
+        struct xrandr_output_info                *o = &snap->outputs[i];
+        const struct xrandr_output_state        *state = NULL;
+        XRRModeInfo                                *mode = NULL;
+        
+        /* a monitor without outputs has no crtc, mode nor rotation */
+        if (o->id == None)
+            continue;
+        for (j = 0; j < nstates; j++)
+            if (states[j].output == o->id)
+                state = &states[j];
+        for (m = 0; state && m < snap->nmode; m++)
+            if (snap->modes[m].id == state->mode)
+                mode = &snap->modes[m];
+        if (!mode)
+            return False;
+        o->crtc = snap->one_crtc[i] ? state->crtc : None;
+        o->mode = mode->id;
+        o->refresh = mode_refresh (mode);
+        o->rotation = state->rotation;
+    }
+    snap->monitors_only = False;
+    return True;
+}
+
+struct xrandr_snapshot *
+xrandr_snapshot_new (int noutputs)
+{
+    struct xrandr_snapshot *snap = snapshot_new ();
+
+    if (!snap)
+        return NULL;
+    snap->noutputs = noutputs;
+    snap->outputs = arena_alloc (&snap->arena, noutputs *
+                                 sizeof (struct xrandr_output_info));
+    if (!snap->outputs)
+    {
+        xrandr_snapshot_free (snap);
+        return NULL;
+    }
+    return snap;
+}
+
+struct xrandr_snapshot *
+xrandr_snapshot_copy (const struct xrandr_snapshot *snap)
+{
+    struct xrandr_snapshot *copy = xrandr_snapshot_new (snap->noutputs);
+    
+    if (!copy)
+        return NULL;
+    copy->reprobed = snap->reprobed;
+    copy->has_monitors = snap->has_monitors;
+    copy->monitors_only = snap->monitors_only;
+    copy->timestamp = snap->timestamp;
+    copy->config_timestamp = snap->config_timestamp;
+    memcpy (copy->outputs, snap->outputs, 
+            snap->noutputs * sizeof (struct xrandr_output_info));
+    return copy;
+}
+
+void
+xrandr_snapshot_free (struct xrandr_snapshot *snap)
+{
+    struct xrandr_arena a;
+    
+    if (!snap)
+        return;
+    
+    /* forget the probe state of this thread if it belongs to this snapshot */
+    if (snap->res && snap->res == res)
+    {
+        res = NULL;
+        crtcs = NULL;
+        num_crtcs = 0;
+        outputs = NULL;
+        outputs_tail = &outputs;
+    }
+    
+    /* the resources are in the arena too */
+    a = snap->arena;
+    arena_release (&a);
+}
+
+int
+xrandr_round_trips (void)
+{
+    int        n;
+    
+    pthread_mutex_lock (&state_lock);
+    n = last_probe_stats.round_trips;
+    pthread_mutex_unlock (&state_lock);
+    return n;
+}
+
+void
+xrandr_last_probe_stats (struct xrandr_probe_stats *stats)
+{
+    pthread_mutex_lock (&state_lock);
+    *stats = last_probe_stats;
+    pthread_mutex_unlock (&state_lock);
+}
+
+#ifdef XRANDR_BENCH
+
+/*
+ * Standalone probe benchmark: probe the display repeatedly and report
+ * the latency of each phase and the cost of a probe. With -soak, the
+ * resident set size is reported around a run of probes and frees, which
+ * should leave it where it was.
+ */
+
+static int
+cmp_double (const void *a, const void *b)
+{
+    double        x = *(const double *) a, y = *(const double *) b;
+    
+    return x < y ? -1 : x > y;
+}
+
+static void
+report_phase (const char *name, double *samples, int n)
+{
+    qsort (samples, n, sizeof (double), cmp_double);
+    printf ("%-12s p50 %8.3f  p95 %8.3f  p99 %8.3f  max %8.3f ms\n", name,
+            samples[n / 2], samples[(n * 95) / 100], samples[(n * 99) / 100],
+            samples[n - 1]);
+}
+
+/* resident set size in kilobytes, -1 if it cannot be told */
+static long
+rss_kb (void)
+{
+    FILE        *f = fopen ("/proc/self/statm", "r");
+    long        size, resident = -1;
+    
+    if (!f)
+        return -1;
+    if (fscanf (f, "%ld %ld", &size, &resident) != 2)
+        resident = -1;
+    fclose (f);
+    if (resident < 0)
+        return -1;
+    return resident * (sysconf (_SC_PAGESIZE) / 1024);
+}
+
+static void
+usage (void)
+{
+    fprintf (stderr, "usage: %s [-display <display>] [-n <iterations>] [-reprobe]"
+             " [-monitors] [-soak <cycles>]\n", program_name);
+    exit (1);
+}
+
+static struct xrandr_snapshot *
+bench_probe (Bool monitors, Bool reprobe)
+{
+    if (monitors)
+        return xrandr_probe_monitors (dpy);
+    return xrandr_probe (dpy, reprobe);
 }
 
 int
 main (int argc, char **argv)
 {
     char          *display_name = NULL;
-    int outputs;
-    struct xrandr_output_info** result = xrandr_init(XOpenDisplay (display_name), display_name, &outputs);
-    return outputs;
+    struct xrandr_snapshot *snap;
+    int                iterations = 1000;
+    int                soak = 0;
+    long        rss_before, rss_after;
+    Bool        reprobe = False;
+    Bool        monitors_only = False;
+    double        *screen_ms, *crtcs_ms, *outputs_ms, *total_ms;
+    int                i, noutputs = 0, ncrtc = 0;
+    
+    program_name = argv[0];
+    for (i = 1; i < argc; i++) {
+        if (!strcmp ("-display", argv[i]) || !strcmp ("-d", argv[i])) {
+            if (++i >= argc) usage ();
+            display_name = argv[i];
+        } else if (!strcmp ("-n", argv[i])) {
+            if (++i >= argc) usage ();
+            iterations = atoi (argv[i]);
+        } else if (!strcmp ("-reprobe", argv[i])) {
+            reprobe = True;
+        } else if (!strcmp ("-monitors", argv[i])) {
+            monitors_only = True;
+        } else if (!strcmp ("-soak", argv[i])) {
+            if (++i >= argc) usage ();
+            soak = atoi (argv[i]);
+            if (soak < 1) usage ();
+        } else
+            usage ();
+    }
+    if (iterations < 1 || (monitors_only && reprobe))
+        usage ();
+    
+    dpy = XOpenDisplay (display_name);
+    if (dpy == NULL)
+        fatal ("Can't open display %s\n", XDisplayName (display_name));
+    
+    screen_ms = malloc (4 * iterations * sizeof (double));
+    if (!screen_ms) fatal ("out of memory\n");
+    crtcs_ms = screen_ms + iterations;
+    outputs_ms = crtcs_ms + iterations;
+    total_ms = outputs_ms + iterations;
+    
+    /* the first probe queries the version; keep it out of the figures */
+    snap = bench_probe (monitors_only, reprobe);
+    if (!snap)
+        fatal ("probe failed%s\n", 
+               monitors_only ? ", the server may have no monitors" : "");
+    xrandr_snapshot_free (snap);
+    
+    for (i = 0; i < iterations; i++) {
+        snap = bench_probe (monitors_only, reprobe);
+        if (!snap)
+            return 1;
+        noutputs = snap->noutputs;
+        ncrtc = snap->ncrtc;
+        xrandr_snapshot_free (snap);
+        
+        screen_ms[i] = probe_stats.screen_ms;
+        crtcs_ms[i] = probe_stats.crtcs_ms;
+        outputs_ms[i] = probe_stats.outputs_ms;
+        total_ms[i] = screen_ms[i] + crtcs_ms[i] + outputs_ms[i];
+    }
+    
+    printf ("%d probes (%s), %d crtcs, %d active outputs\n", iterations,
+            monitors_only ? "monitors" : reprobe ? "reprobe" : "cached", 
+            ncrtc, noutputs);
+    report_phase ("get_screen", screen_ms, iterations);
+    report_phase ("get_crtcs", crtcs_ms, iterations);
+    report_phase ("get_outputs", outputs_ms, iterations);
+    report_phase ("total", total_ms, iterations);
+    printf ("per probe: %lu requests, %d round trips, %lu bytes allocated\n",
+            probe_stats.requests, probe_stats.round_trips,
+            (unsigned long) probe_stats.bytes);
+    
+    /* the timed run above has warmed up malloc and xcb by now */
+    if (soak > 0) {
+        rss_before = rss_kb ();
+        for (i = 0; i < soak; i++) {
+            snap = bench_probe (monitors_only, reprobe);
+            if (!snap)
+                return 1;
+            xrandr_snapshot_free (snap);
+        }
+        rss_after = rss_kb ();
+        printf ("soak: %d probes, rss %ld kB before, %ld kB after (%+ld kB)\n",
+                soak, rss_before, rss_after, rss_after - rss_before);
+    }
+    
+    free (screen_ms);
+    XCloseDisplay (dpy);
+    return 0;
 }
+
+#endif /* XRANDR_BENCH */
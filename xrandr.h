@@ -1,10 +1,248 @@
+#ifndef ION_MOD_XRANDR_XRANDR_H
+#define ION_MOD_XRANDR_XRANDR_H
+
+#define XRANDR_NAME_MAX 64
+
 struct xrandr_output_info
 {
+    /** output XID and connector name, together identifying the output */
+    RROutput id;
+    char name[XRANDR_NAME_MAX];
+    /** crtc driving the output */
+    RRCrtc crtc;
     int x;
     int y;
     int w;
     int h;
+    Rotation rotation;
+    /** current mode and its refresh rate in Hz */
+    RRMode mode;
+    double refresh;
+    /** physical size in millimetres, 0 if unknown */
+    unsigned long mm_width;
+    unsigned long mm_height;
+    Bool primary;
+};
+
+struct xrandr_arena_chunk;
+
+/** memory allocated in chunks and released at once */
+struct xrandr_arena
+{
+    struct xrandr_arena_chunk *chunks;
+};
+
+/** 
+ * Result of a probe. All of it, including the snapshot itself, lives in 
+ * the arena and is released by xrandr_snapshot_free. 
+ */
+struct xrandr_snapshot
+{
+    /** True if the server reprobed the hardware for this snapshot */
+    Bool reprobed;
+    /** 
+     * True if the outputs are the monitors of RandR 1.5, which change
+     * without crtc or output events
+     */
+    Bool has_monitors;
+    /**
+     * True if only the monitor list was probed: the outputs have no crtc,
+     * mode, refresh rate nor rotation yet, see xrandr_complete_snapshot
+     */
+    Bool monitors_only;
+    /** times the probe waited for a server reply */
+    int round_trips;
+    Time timestamp;
+    Time config_timestamp;
+    /** connected outputs with a mode */
+    int noutputs;
+    struct xrandr_output_info *outputs;
+    
+    struct xrandr_arena arena;
+    /* private: the probe state, NULL in copies */
+    XRRScreenResources *res;
+    int width;
+    int height;
+    double dpi;
+    int min_width, max_width;
+    int min_height, max_height;
+    Bool has_1_3;
+    /* modes the server knows, also in snapshots of the monitor list */
+    XRRModeInfo *modes;
+    int nmode;
+    /* in snapshots of the monitor list, whether each is all of one crtc */
+    Bool *one_crtc;
+    struct _crtc *crtcs;
+    int ncrtc;
+    struct _output *output_list;
+};
+
+/** 
+ * Probe all connected outputs. Unless reprobe is set, the configuration 
+ * cached by the server is used (RandR >= 1.3). Probes may be done on a
+ * thread of their own, with a connection of its own; they do not wait for
+ * planning functions working on another thread, nor these for them. A 
+ * snapshot is planned against on one thread at a time. Returns NULL if 
+ * the probe fails; nothing is kept of it then.
+ */
+extern struct xrandr_snapshot *xrandr_probe(Display *dpy, Bool reprobe);
+
+/** probe the X server, whichever backend is in use */
+extern struct xrandr_snapshot *xrandr_probe_server(Display *dpy, Bool reprobe);
+
+/**
+ * Probe only the monitor list of the X server (RandR >= 1.5), with one 
+ * round trip and without reprobing. The outputs have their name, 
+ * geometry, physical size and primary flag; there is no probe state to 
+ * plan against. Returns NULL if the server has no monitors or the probe
+ * fails.
+ */
+extern struct xrandr_snapshot *xrandr_probe_monitors(Display *dpy);
+
+/** crtc, mode and rotation of an output, as told by change events */
+struct xrandr_output_state
+{
+    RROutput output;
+    RRCrtc crtc;
+    RRMode mode;
+    Rotation rotation;
+};
+
+/**
+ * Fill in the crtc, mode, refresh rate and rotation of the outputs of
+ * snap, a probe of the monitor list, from states. Returns False if an 
+ * output is not in states or its mode is unknown to the server; snap is
+ * then only good for freeing.
+ */
+extern Bool xrandr_complete_snapshot(struct xrandr_snapshot *snap,
+                                     const struct xrandr_output_state *states,
+                                     int nstates);
+
+/** empty snapshot with room for noutputs outputs, NULL if out of memory */
+extern struct xrandr_snapshot *xrandr_snapshot_new(int noutputs);
+
+/** copy of the outputs of snap, without the probe state */
+extern struct xrandr_snapshot *xrandr_snapshot_copy(const struct xrandr_snapshot *snap);
+
+extern void xrandr_snapshot_free(struct xrandr_snapshot *snap);
+
+/** 
+ * Source of the snapshots returned by xrandr_probe. The default backend 
+ * queries the RandR extension of the display. 
+ */
+struct xrandr_backend
+{
+    const char *name;
+    struct xrandr_snapshot *(*probe)(Display *dpy, Bool reprobe);
+    /** True if RandR events on the display report changes of this backend */
+    Bool x_events;
+};
+
+/** use backend for probing, or the X server if NULL */
+extern void xrandr_set_backend(const struct xrandr_backend *backend);
+
+extern const struct xrandr_backend *xrandr_get_backend(void);
+
+/** gamma curve of a crtc, approximated as value = brightness*input^gamma */
+struct xrandr_gamma
+{
+    double red;
+    double green;
+    double blue;
+    double brightness;
+    /** number of entries in the ramps */
+    int size;
+};
+
+/** query the gamma ramps of crtc from the server */
+extern Bool xrandr_crtc_gamma(Display *dpy, RRCrtc crtc, 
+                              struct xrandr_gamma *gamma);
+
+/** 
+ * query the current transform and panning of an active crtc from the
+ * server. has_panning is cleared if the crtc does not pan.
+ */
+extern Bool xrandr_crtc_transform(Display *dpy, RRCrtc crtc,
+                                  XTransform *transform, XRRPanning *panning,
+                                  Bool *has_panning);
+
+/** requested state of an output */
+struct xrandr_output_config
+{
+    char name[XRANDR_NAME_MAX];
+    /** False to turn the output off */
+    Bool enabled;
+    /** mode name such as "1920x1080", empty for the preferred mode */
+    char mode[XRANDR_NAME_MAX];
+    /** refresh rate to pick among modes of that name, 0 for any */
+    double refresh;
+    int x;
+    int y;
+    Rotation rotation;
+    Bool primary;
 };
 
-/** return information about all connected outputs */
-extern struct xrandr_output_info** xrandr_init(Display *dpy, char *display_name, int* noutputs);
+/** requests that apply a layout, made by xrandr_plan_layout */
+struct xrandr_plan;
+
+/**
+ * Check configs against the outputs, modes and crtcs of snap, which must
+ * be a probe of the X server, and work out the requests applying them. 
+ * Outputs that are not mentioned keep their state. Returns NULL and 
+ * describes the problem in error if the layout cannot be used. The plan
+ * does not refer to snap; free it with xrandr_plan_free.
+ */
+extern struct xrandr_plan *xrandr_plan_layout(struct xrandr_snapshot *snap,
+                                              const struct xrandr_output_config *configs, 
+                                              int nconfigs, 
+                                              char *error, int errlen);
+
+extern void xrandr_plan_free(struct xrandr_plan *plan);
+
+/** True if applying plan would not change anything */
+extern Bool xrandr_plan_is_empty(const struct xrandr_plan *plan);
+
+/**
+ * Check that the outputs of configs that are connected in snap, a probe
+ * of the X server, can use the mode and rotation asked for, and have a 
+ * crtc. Outputs that are not connected are not checked.
+ */
+extern Bool xrandr_check_layout(struct xrandr_snapshot *snap,
+                                const struct xrandr_output_config *configs, 
+                                int nconfigs, 
+                                char *error, int errlen);
+
+/** True if configs mention exactly the outputs connected in snap */
+extern Bool xrandr_layout_matches(struct xrandr_snapshot *snap,
+                                  const struct xrandr_output_config *configs, 
+                                  int nconfigs);
+
+/**
+ * Apply plan with the server grabbed: crtcs in the way are turned off, 
+ * the screen is resized once and then all changed crtcs are set.
+ */
+extern Bool xrandr_plan_apply(Display *dpy, const struct xrandr_plan *plan,
+                              char *error, int errlen);
+
+/** measurements of a probe */
+struct xrandr_probe_stats
+{
+    /** time spent in each phase */
+    double screen_ms;
+    double crtcs_ms;
+    double outputs_ms;
+    /** X requests sent */
+    unsigned long requests;
+    /** times the probe waited for a server reply */
+    int round_trips;
+    /** memory allocated for the snapshot */
+    size_t bytes;
+};
+
+/** number of times the last xrandr_probe call waited for a server reply */
+extern int xrandr_round_trips(void);
+
+/** copy the measurements of the last probe, on whichever thread, to stats */
+extern void xrandr_last_probe_stats(struct xrandr_probe_stats *stats);
+
+#endif /* ION_MOD_XRANDR_XRANDR_H */